@@ -0,0 +1,116 @@
+/*
+ * 每轮在nr_tables个2MB的table中随机写入4KB，然后fsync。
+ * 用-D_LIBNVMMIO_TIME编译时输出每次fsync的fence个数，
+ * 检查点按table batch fence后，它与table个数而不是entry个数成正比。
+ *
+ * usage: fsyncbench [nr_tables] [writes_per_table] [rounds]
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libnvmmio.h>
+
+#ifdef _LIBNVMMIO_TIME
+#include "../../src/debug.h"
+#else
+#define handle_error(msg) \
+	do { \
+		perror(msg); \
+		exit(EXIT_FAILURE); \
+	} while (0)
+#endif
+
+#define FILE_PATH "/mnt/pmem/fsyncbench"
+#define TABLE_SIZE (1UL << 21)
+#define BUF_SIZE (1UL << 12)
+
+static unsigned long nr_fences(void) {
+	unsigned long sum = 0;
+#ifdef _LIBNVMMIO_TIME
+	long cpu, nrcpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (cpu = 0; cpu < nrcpus; cpu++) {
+		sum += countstats_percpu[nvmmio_fence_t][cpu];
+	}
+#endif
+	return sum;
+}
+
+static double elapsed_us(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+	       (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long nr_tables = 16, writes = 256, rounds = 16;
+	unsigned long i, r, fences, write_fences = 0, sync_fences = 0;
+	struct timespec start, end;
+	double sync_us = 0;
+	char buf[BUF_SIZE];
+	off_t offset;
+	int fd;
+
+	if (argc > 1) nr_tables = strtoul(argv[1], NULL, 0);
+	if (argc > 2) writes = strtoul(argv[2], NULL, 0);
+	if (argc > 3) rounds = strtoul(argv[3], NULL, 0);
+
+	memset(buf, 'a', BUF_SIZE);
+	srand(1);
+
+	fd = open(FILE_PATH, O_CREAT | O_RDWR | O_ATOMIC);
+	if (fd == -1) {
+		handle_error("open");
+	}
+
+	/* 先把文件写满，之后的写入都是覆盖写 */
+	for (i = 0; i < nr_tables * TABLE_SIZE; i += BUF_SIZE) {
+		if (pwrite(fd, buf, BUF_SIZE, i) != BUF_SIZE) {
+			handle_error("pwrite");
+		}
+	}
+	if (fsync(fd) != 0) {
+		handle_error("fsync");
+	}
+
+	for (r = 0; r < rounds; r++) {
+		buf[0] = 'b' + r % 16;
+		fences = nr_fences();
+
+		for (i = 0; i < nr_tables * writes; i++) {
+			offset = (off_t)(rand() % (nr_tables * TABLE_SIZE / BUF_SIZE)) * BUF_SIZE;
+			if (pwrite(fd, buf, BUF_SIZE, offset) != BUF_SIZE) {
+				handle_error("pwrite");
+			}
+		}
+		write_fences += nr_fences() - fences;
+
+		fences = nr_fences();
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (fsync(fd) != 0) {
+			handle_error("fsync");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		sync_fences += nr_fences() - fences;
+		sync_us += elapsed_us(&start, &end);
+	}
+
+	printf("tables %lu, writes per fsync %lu, fsync %.1f us", nr_tables,
+	       nr_tables * writes, sync_us / rounds);
+#ifdef _LIBNVMMIO_TIME
+	printf(", fences per write %.2f, fences per fsync %.1f",
+	       (double)write_fences / (nr_tables * writes * rounds),
+	       (double)sync_fences / rounds);
+#endif
+	printf("\n");
+
+	if (close(fd) != 0) {
+		handle_error("close");
+	}
+	return 0;
+}
@@ -28,6 +28,21 @@ extern off_t nvlseek(int fd, off_t offset, int whence);
 extern int nvftruncate(int fd, off_t length);
 #define fsync(fd) nvfsync(fd)
 extern int nvfsync(int fd);
+/* 显式事务：nvtx_begin()之后的写入在nvtx_commit()时一起提交，
+ * nvtx_abort()丢弃这些写入 */
+extern int nvtx_begin(int fd);
+extern int nvtx_commit(int fd);
+extern int nvtx_abort(int fd);
+/* 组提交：fds中的文件用一个commit record一起提交 */
+extern int nvfsync_group(const int *fds, int nr);
+/* 异步fsync：立即返回，之前的写入全部写回后调用cb并向eventfd efd写1。
+ * 已经全部写回时cb在返回之前由当前线程调用，否则在同步线程中调用 */
+extern int nvfsync_async(int fd, nvfsync_cb_t cb, void *cookie, int efd);
+
+/* hybrid logging的代价模型：读写参数，或用trace中的统计离线评估选择的策略 */
+extern void nvpolicy_get_params(nvpolicy_params_t *params);
+extern int nvpolicy_set_params(const nvpolicy_params_t *params);
+extern int nvpolicy_choose(const nvpolicy_stats_t *stats, int current);
 
 #define pread(fd, buf, count, offset) nvpread(fd, buf, count, offset)
 extern ssize_t nvpread(int fd, void *buf, size_t cnt, off_t offset);
@@ -43,6 +58,11 @@ extern ssize_t nvpreadv(int fd, const struct iovec *iov, int iovcnt,
 #define pwritev(fd, iov, iovcnt, offset) nvpwritev(fd, iov, iovcnt, offset)
 extern ssize_t nvpwritev(int fd, const struct iovec *iov, int iovcnt,
                          off_t offset);
+/* 零拷贝读取：spans指向映射文件或log数据，用完后调用nvpread_zc_release() */
+extern ssize_t nvpread_zc(int fd, size_t cnt, off_t offset,
+                          struct iovec *spans, int *nr_spans,
+                          nvlease_t *lease);
+extern void nvpread_zc_release(nvlease_t *lease);
 #define readv(fd, iov, iovcnt) nvreadv(fd, iov, iovcnt)
 extern ssize_t nvreadv(int fd, const struct iovec *iov, int iovcnt);
 #define writev(fd, iov, iovcnt) nvwritev(fd, iov, iovcnt)
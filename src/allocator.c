@@ -9,40 +9,127 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <stdbool.h>
+#include <sys/file.h>
+#include <sched.h>
 
 #include "allocator.h"
 #include "internal.h"
+#include "sync.h"
 #include "debug.h"
 
-#define DIR_PATH "%s/.libnvmmio-%lu"
-#define DATA_PATH "%s/.libnvmmio-%lu/data-%d.log"
-#define ENTRIES_PATH "%s/.libnvmmio-%lu/entries.log"
-#define UMAS_PATH "%s/.libnvmmio-%lu/umas.log"
+#define ENTRIES_CHUNK_SIZE \
+  ((LOG_CHUNK_SIZE >> PAGE_SHIFT) * sizeof(log_record_t))
+#define SUBPAGE_CHUNK_SIZE (LOG_CHUNK_SIZE >> 4)
+#define LOG_RESERVE_SIZE (64)          /* 每种log size最多预留的entry个数 */
+#define LOG_RESERVE_BYTES (1UL << 18)  /* 每种log size最多预留的data大小 */
+#define NR_FREELIST_SHARDS (16)        /* 每个global list按CPU分成的片数 */
+#define MAGAZINE_TAG_SHIFT (48)        /* 栈顶指针的高16位用作tag */
+#define MAGAZINE_PTR_MASK ((1UL << MAGAZINE_TAG_SHIFT) - 1)
+#define MAX_LOCAL_MAGAZINES (8)        /* 线程缓存的空闲magazine描述符个数 */
+#define MAX_NR_TABLES (1UL << 20)      /* table池预留的table个数 */
+#define LOCAL_LIST_SIZE (MAX_FREE_NODES + 1)
 
-typedef struct freelist_struct {
-  list_node_t *head;
+/**
+ * @brief 最多NR_FILL_NODES个空闲块的下标，global list以整个magazine为单位存取
+ * 描述符从不释放，只在magazine_pool和线程缓存之间复用，
+ * 出栈时读到的next总是可访问的
+ */
+typedef struct magazine_struct {
+  struct magazine_struct *next;
   unsigned long count;
-  pthread_mutex_t mutex;
+  unsigned int blocks[NR_FILL_NODES];
+} magazine_t;
+
+/**
+ * @brief global list的一个分片，magazine组成的无锁栈
+ * top的低48位是栈顶magazine，高16位是避免ABA的tag
+ */
+typedef struct freelist_shard_struct {
+  unsigned long top;
+} __attribute__((aligned(64))) freelist_shard_t;
+
+/**
+ * @brief 一个连续块池的空闲块，块用它在池中的下标表示
+ */
+typedef struct freelist_struct {
+  unsigned long count;    /* 用原子操作更新 */
+  freelist_shard_t *shards;
+  pthread_mutex_t mutex;  /* 只用于串行化扩展 */
+  unsigned long low_mark; /* 空闲块低于该值时加速同步 */
+  unsigned long min_mark; /* 空闲块低于该值时限制写线程 */
+  int fd;                 /* 按需扩展的log文件，-1表示DRAM中的池 */
+  void *base;             /* 为limit个块预留的连续地址空间 */
+  size_t block_size;      /* 每个块的大小 */
+  unsigned long mapped;   /* 已映射的块数 */
+  unsigned long limit;    /* 最多可映射的块数 */
+  log_entry_t *shadow;    /* entries list中与record一一对应的shadow entry */
 } freelist_t;
 
+/**
+ * @brief 线程缓存的空闲块下标，取一个块只是数组上的一次出栈
+ */
+typedef struct local_list_struct {
+  unsigned long count;
+  unsigned int blocks[LOCAL_LIST_SIZE];
+} local_list_t;
+
+/**
+ * @brief 线程为每种log size预留的entry，data块已经挂在entry上
+ * 跨多个entry的写入先一次预留足够的entry，之后每次分配只是数组上的一次出栈；
+ * 本线程释放的entry连同data块直接放回，不再拆开放进两个链表
+ */
+typedef struct log_reservation_struct {
+  unsigned long count;
+  unsigned long limit; /* 大块的log少预留一些 */
+  log_entry_t *entries[LOG_RESERVE_SIZE];
+} log_reservation_t;
+
 static pthread_t background_table_alloc_thread;
 static pthread_cond_t background_table_alloc_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t background_table_alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
 static volatile int background_table_alloc = false;
 
-static freelist_t *global_tables_list = NULL;/* 指向table空间的指针链表 */
-static freelist_t *global_entries_list = NULL; /* 指向entries空间的指针链表 */
-static freelist_t *global_data_list[NR_LOG_SIZES] = {NULL, }; /* 指向data空间的指针链表 */
-static freelist_t *global_uma_list = NULL;/* 指向uma空间的指针链表 */
-
-static __thread freelist_t *local_tables_list = NULL;
-static __thread freelist_t *local_entries_list = NULL;
-static __thread freelist_t *local_data_list[NR_LOG_SIZES] = {NULL, };
-static __thread list_node_t *local_node_head = NULL;
+/* 每个log node一套池，写线程从所在NUMA node对应的log node分配 */
+static freelist_t *global_tables_list[MAX_NR_LOG_NODES]; /* DRAM中的table池 */
+static freelist_t *global_entries_list[MAX_NR_LOG_NODES]; /* 下标同时对应shadow entry和record */
+static freelist_t *global_data_list[MAX_NR_LOG_NODES][NR_LOG_SIZES];
+
+/* uma只在mmap/munmap时分配和释放，用一个加锁的下标栈 */
+static pthread_mutex_t global_umas_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int global_umas[MAX_NR_UMAS];
+static unsigned long nr_global_umas = 0;
+
+/* 只从本线程的log node分配table和entry，释放的块按所属log node缓存 */
+static __thread int local_node = -1;
+static __thread local_list_t *local_tables_list = NULL;
+static __thread local_list_t *local_entries_list[MAX_NR_LOG_NODES];
+static __thread local_list_t *local_data_list[MAX_NR_LOG_NODES][NR_LOG_SIZES];
+static unsigned long magazine_pool = 0; /* 空闲的magazine描述符，带tag的栈顶 */
+static __thread magazine_t *local_magazine_head = NULL;
+static __thread unsigned long local_magazine_count = 0;
+static __thread log_reservation_t *local_reservation[NR_LOG_SIZES] = {NULL, };
 
 static int umaid = -1;
-static char *pmem_path;
+static char *pmem_paths[MAX_NR_LOG_NODES]; /* 第0个路径同时保存uma等元数据 */
+static int nr_log_nodes = 0;
 static unsigned long libnvmmio_pid;
+/* 持有log目录的flock，表示该目录的进程仍然存活 */
+static int log_dir_fds[MAX_NR_LOG_NODES];
+
+static uma_t *umas_base = NULL;
+static unsigned long *applied_base = NULL;
+static commit_record_t *commit_record = NULL;
+static int applied_fd = -1;
+
+static inline void set_watermarks(freelist_t *list, unsigned long total) {
+  list->low_mark = total / 100 * LOG_LOW_WATERMARK;
+  list->min_mark = total / 100 * LOG_MIN_WATERMARK;
+}
+
+/* 尚未映射的部分也算作空闲空间 */
+static inline unsigned long free_blocks(freelist_t *list) {
+  return list->count + (list->limit - list->mapped);
+}
 
 static inline int get_uma_id(void) {
   int old, new;
@@ -57,7 +144,7 @@ static inline int get_uma_id(void) {
   return new;
 }
 
-static void rmlogs(char *path) {
+void rmlogs(const char *path) {
 	DIR * dir_ptr = NULL;
 	struct dirent *file = NULL;
 	char filename[1024];
@@ -116,33 +203,71 @@ static char *size2str(size_t size, char *buf) {
 }
 #endif /* _LIBNVMMIO_DEBUG */
 
+static int open_logfile(const char *path) {
+  int fd;
+
+  fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (__glibc_unlikely(fd == -1)) {
+    handle_error("open");
+  }
+  return fd;
+}
+
+/**
+ * @brief 只预留地址空间，不分配内存
+ */
+static void *reserve_address(size_t len) {
+  void *addr;
+
+  addr = mmap(0, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+              -1, 0);
+  if (__glibc_unlikely(addr == MAP_FAILED)) {
+    handle_error("mmap");
+  }
+  return addr;
+}
+
+/**
+ * @brief 将log文件[offset, offset + len)扩展并映射
+ * @param addr 非NULL时映射到预留的地址空间中
+ */
+static void *map_logfile_chunk(void *addr, int fd, off_t offset, size_t len) {
+  int flags = MAP_SHARED | MAP_POPULATE;
+  int s;
+
+  s = posix_fallocate(fd, offset, len);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("fallocate");
+  }
+
+  if (addr != NULL) {
+    flags |= MAP_FIXED;
+  }
+
+  addr = mmap(addr, len, PROT_READ | PROT_WRITE, flags, fd, offset);
+  if (__glibc_unlikely(addr == MAP_FAILED)) {
+    handle_error("mmap");
+  }
+  return addr;
+}
+
 static void *map_logfile(const char *path, size_t len) {
   void *addr;
-  int fd, s;
-  int flags;
+  int fd;
 #ifdef _LIBNVMMIO_DEBUG
   char buf[10];
 #endif /* LIBNVMMIO_DEBUG */
 
   if (path == NULL) {
-    fd = -1;
-    flags = MAP_ANONYMOUS | MAP_SHARED;
-  } else {
-    fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
-    if (__glibc_unlikely(fd == -1)) {
-      handle_error("open");
-    }
-
-    s = posix_fallocate(fd, 0, len);
-    if (__glibc_unlikely(s != 0)) {
-      handle_error("fallocate");
+    addr = mmap(0, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED,
+                -1, 0);
+    if (__glibc_unlikely(addr == MAP_FAILED)) {
+      handle_error("mmap");
     }
-    flags = MAP_SHARED | MAP_POPULATE;
-  }
-
-  addr = mmap(0, len, PROT_READ | PROT_WRITE, flags, fd, 0);
-  if (__glibc_unlikely(addr == MAP_FAILED)) {
-    handle_error("mmap");
+  } else {
+    fd = open_logfile(path);
+    addr = map_logfile_chunk(NULL, fd, 0, len);
+    close(fd);
   }
 
 	LIBNVMMIO_DEBUG("file:%s, size:%s", path, size2str(len, buf));
@@ -150,89 +275,249 @@ static void *map_logfile(const char *path, size_t len) {
   return addr;
 }
 
-list_node_t *alloc_list_node(void) {
-  list_node_t *node;
+/**
+ * @brief 带tag的无锁栈，top的高16位每次修改加一
+ */
+static void push_tagged(unsigned long *top, magazine_t *mag) {
+  unsigned long old, new;
+
+  old = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+  do {
+    mag->next = (magazine_t *)(old & MAGAZINE_PTR_MASK);
+    new = (((old >> MAGAZINE_TAG_SHIFT) + 1) << MAGAZINE_TAG_SHIFT) |
+          (unsigned long)mag;
+  } while (!__atomic_compare_exchange_n(top, &old, new, true, __ATOMIC_RELEASE,
+                                        __ATOMIC_ACQUIRE));
+}
+
+static magazine_t *pop_tagged(unsigned long *top) {
+  magazine_t *mag;
+  unsigned long old, new;
+
+  old = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+  do {
+    mag = (magazine_t *)(old & MAGAZINE_PTR_MASK);
+    if (mag == NULL) {
+      return NULL;
+    }
+    new = (((old >> MAGAZINE_TAG_SHIFT) + 1) << MAGAZINE_TAG_SHIFT) |
+          (unsigned long)mag->next;
+  } while (!__atomic_compare_exchange_n(top, &old, new, true, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE));
+  return mag;
+}
 
-  if (local_node_head == NULL) {
-    node = (list_node_t *)malloc(sizeof(list_node_t));
-    if (__glibc_unlikely(node == NULL)) {
+static magazine_t *alloc_magazine(void) {
+  magazine_t *mag;
+
+  if (local_magazine_head != NULL) {
+    mag = local_magazine_head;
+    local_magazine_head = mag->next;
+    local_magazine_count--;
+    return mag;
+  }
+
+  mag = pop_tagged(&magazine_pool);
+  if (mag == NULL) {
+    mag = (magazine_t *)malloc(sizeof(magazine_t));
+    if (__glibc_unlikely(mag == NULL)) {
       handle_error("malloc");
     }
+  }
+  return mag;
+}
+
+/* 只取不放的线程会攒下描述符，超过缓存上限的放回magazine_pool */
+static void free_magazine(magazine_t *mag) {
+  mag->count = 0;
+
+  if (local_magazine_count < MAX_LOCAL_MAGAZINES) {
+    mag->next = local_magazine_head;
+    local_magazine_head = mag;
+    local_magazine_count++;
   } else {
-    node = local_node_head;
-    local_node_head = local_node_head->next;
+    push_tagged(&magazine_pool, mag);
   }
-  node->next = NULL;
-  return node;
 }
 
-static void free_node(list_node_t *node) {
-  node->ptr = NULL;
-  node->next = local_node_head;
-  local_node_head = node;
+static void init_global_shards(freelist_t *list) {
+  list->shards = (freelist_shard_t *)aligned_alloc(
+      sizeof(freelist_shard_t), NR_FREELIST_SHARDS * sizeof(freelist_shard_t));
+  if (__glibc_unlikely(list->shards == NULL)) {
+    handle_error("aligned_alloc");
+  }
+  memset(list->shards, 0, NR_FREELIST_SHARDS * sizeof(freelist_shard_t));
+  list->count = 0;
 }
 
-static void init_entries_lock(list_node_t *head) {
-  log_entry_t *entry;
+static inline freelist_shard_t *get_local_shard(freelist_t *list) {
+  int cpu = sched_getcpu();
 
-  while (head) {
-    entry = (log_entry_t *)(head->ptr);
-    entry->rwlockp = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t));
-    if (__glibc_unlikely(entry->rwlockp == NULL)) {
-      handle_error("malloc for rwlockp");
-    }
-    head = head->next;
+  if (__glibc_unlikely(cpu < 0)) {
+    cpu = 0;
   }
+  return &list->shards[cpu % NR_FREELIST_SHARDS];
 }
 
-static list_node_t *create_list(void *address, size_t size, unsigned long count,
-                                list_node_t **tail) {
-  list_node_t *node;
-  list_node_t *head = NULL;
-  unsigned long i;
+/**
+ * @brief 把blocks中的count个下标作为一个magazine压入当前CPU的分片
+ * 先加count再入栈，并发读到的count不会小于栈中的块数
+ */
+static void push_magazine(freelist_t *list, const unsigned int *blocks,
+                          unsigned long count) {
+  magazine_t *mag = alloc_magazine();
+
+  memcpy(mag->blocks, blocks, count * sizeof(unsigned int));
+  mag->count = count;
+
+  __atomic_add_fetch(&list->count, count, __ATOMIC_RELAXED);
+  push_tagged(&get_local_shard(list)->top, mag);
+}
 
-  if (tail != NULL) {
-    *tail = NULL;
+/**
+ * @brief 从global list取一个magazine追加到local list
+ * 先取当前CPU的分片，为空时依次从其它分片取，全部为空时返回false
+ */
+static bool get_magazine(freelist_t *global_list, local_list_t *local_list) {
+  freelist_shard_t *shard = get_local_shard(global_list);
+  magazine_t *mag;
+  int i, id = shard - global_list->shards;
+
+  for (i = 0; i < NR_FREELIST_SHARDS; i++) {
+    mag = pop_tagged(&global_list->shards[(id + i) % NR_FREELIST_SHARDS].top);
+    if (mag != NULL) {
+      break;
+    }
+  }
+  if (mag == NULL) {
+    return false;
   }
 
-  for (i = 0; i < count; i++) {
-    node = alloc_list_node();
-    node->ptr = address + (i * size);// 指向内存中对应的位置
-    node->next = head;
-    head = node;
+  __atomic_sub_fetch(&global_list->count, mag->count, __ATOMIC_RELAXED);
 
-    if (tail && *tail == NULL) {
-      *tail = node;
+  memcpy(&local_list->blocks[local_list->count], mag->blocks,
+         mag->count * sizeof(unsigned int));
+  local_list->count += mag->count;
+  free_magazine(mag);
+  return true;
+}
+
+/**
+ * @brief 把下标[first, first + count)按NR_FILL_NODES一组放进global list
+ */
+static void push_blocks(freelist_t *list, unsigned long first,
+                        unsigned long count) {
+  unsigned int blocks[NR_FILL_NODES];
+  unsigned long i, n;
+
+  while (count > 0) {
+    n = count < NR_FILL_NODES ? count : NR_FILL_NODES;
+    /* 倒序放入，出栈时先得到地址小的块 */
+    for (i = 0; i < n; i++) {
+      blocks[i] = first + n - 1 - i;
     }
+    push_magazine(list, blocks, n);
+    first += n;
+    count -= n;
   }
-  return head;
 }
 
-static void fill_global_tables_list(int lock) {
-  list_node_t *head;
-  list_node_t *tail;
-  size_t total_size;
+/**
+ * @brief 为log文件再映射一个chunk，并把新的块加入global list
+ * 调用时需持有list->mutex，已达到上限时返回false
+ */
+static bool grow_global_list(freelist_t *list, size_t chunk_size) {
+  unsigned long count, i;
   void *address;
+#ifdef _LIBNVMMIO_DEBUG
+  char buf[10];
+#endif /* LIBNVMMIO_DEBUG */
+
+  count = chunk_size / list->block_size;
+  if (count > list->limit - list->mapped) {
+    count = list->limit - list->mapped;
+  }
+  if (count == 0) {
+    return false;
+  }
+
+  address = list->base + list->mapped * list->block_size;
+  if (list->fd == -1) {
+    address = mmap(address, count * list->block_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (__glibc_unlikely(address == MAP_FAILED)) {
+      handle_error("mmap");
+    }
+  } else {
+    map_logfile_chunk(address, list->fd, list->mapped * list->block_size,
+                      count * list->block_size);
+  }
+
+  /* 下标相同的shadow entry与entries.log中的record关联 */
+  if (list->shadow != NULL) {
+    for (i = list->mapped; i < list->mapped + count; i++) {
+      list->shadow[i].record = (log_record_t *)address + (i - list->mapped);
+    }
+  }
+
+  push_blocks(list, list->mapped, count);
+  list->mapped += count;
+
+  LIBNVMMIO_DEBUG("fd:%d, mapped:%s", list->fd,
+                  size2str(list->mapped * list->block_size, buf));
+  return true;
+}
+
+static inline bool grow_global_entries_list(int node) {
+  return grow_global_list(global_entries_list[node], ENTRIES_CHUNK_SIZE);
+}
+
+/* 小块的chunk也小一些，避免一次放入过多的块 */
+static inline bool grow_global_data_list(int node, log_size_t log_size) {
+  return grow_global_list(global_data_list[node][log_size],
+                          IS_SUBPAGE_LOG(log_size) ? SUBPAGE_CHUNK_SIZE
+                                                   : LOG_CHUNK_SIZE);
+}
 
-  total_size = MAX_FREE_NODES * sizeof(log_table_t);
-  address = map_logfile(NULL, total_size);
-  head = create_list(address, sizeof(log_table_t), MAX_FREE_NODES, &tail);
+/**
+ * @brief 创建一个块池，path为NULL时池在DRAM中
+ */
+static freelist_t *create_global_list(const char *path, size_t block_size,
+                                      unsigned long limit) {
+  freelist_t *list;
 
-  if (lock) {
-    pthread_mutex_lock(&global_tables_list->mutex);
+  list = (freelist_t *)malloc(sizeof(freelist_t));
+  if (__glibc_unlikely(list == NULL)) {
+    handle_error("malloc");
   }
+  pthread_mutex_init(&list->mutex, NULL);
+  init_global_shards(list);
+  list->fd = path == NULL ? -1 : open_logfile(path);
+  list->base = reserve_address(limit * block_size);
+  list->block_size = block_size;
+  list->mapped = 0;
+  list->limit = limit;
+  list->shadow = NULL;
+  set_watermarks(list, limit);
+
+  return list;
+}
+
+static void fill_global_tables_list(int node) {
+  bool grown;
 
-  tail->next = global_tables_list->head;
-  global_tables_list->head = head;
-  global_tables_list->count += MAX_FREE_NODES;
+  pthread_mutex_lock(&global_tables_list[node]->mutex);
+  grown = grow_global_list(global_tables_list[node],
+                           MAX_FREE_NODES * sizeof(log_table_t));
+  pthread_mutex_unlock(&global_tables_list[node]->mutex);
 
-  if (lock) {
-    pthread_mutex_unlock(&global_tables_list->mutex);
+  if (__glibc_unlikely(!grown)) {
+    handle_error("too many log tables");
   }
 }
 
 static void *background_table_alloc_thread_func(__attribute__((unused))void *parm) {
-  int s;
+  int node, s;
   LIBNVMMIO_DEBUG("table_alloc_thread start on %d", sched_getcpu());
 
   while (true) {
@@ -249,7 +534,11 @@ static void *background_table_alloc_thread_func(__attribute__((unused))void *par
       }
     }
     LIBNVMMIO_DEBUG("wake up!!");
-    fill_global_tables_list(true);
+    for (node = 0; node < nr_log_nodes; node++) {
+      if (global_tables_list[node]->count < MAX_FREE_NODES) {
+        fill_global_tables_list(node);
+      }
+    }
     background_table_alloc = false;
 
     s = pthread_mutex_unlock(&background_table_alloc_mutex);
@@ -269,22 +558,14 @@ void exit_background_table_alloc_thread(void) {
 }
 
 static void create_global_tables_list(int count) {
-  void *address;
-  size_t total_size;
-  int s;
+  int node, s;
 
-  if (global_tables_list == NULL) {
-    global_tables_list = (freelist_t *)malloc(sizeof(freelist_t));
-    if (__glibc_unlikely(global_tables_list == NULL)) {
-      handle_error("malloc");
+  if (global_tables_list[0] == NULL) {
+    for (node = 0; node < nr_log_nodes; node++) {
+      global_tables_list[node] =
+          create_global_list(NULL, sizeof(log_table_t), MAX_NR_TABLES);
+      grow_global_list(global_tables_list[node], count * sizeof(log_table_t));
     }
-    pthread_mutex_init(&global_tables_list->mutex, NULL);
-    total_size = count * sizeof(log_table_t);
-    address = map_logfile(NULL, total_size);
-
-    global_tables_list->head =
-        create_list(address, sizeof(log_table_t), count, NULL);
-    global_tables_list->count = count;
 
     /* background thread */
     s = pthread_create(&background_table_alloc_thread, NULL,
@@ -295,296 +576,270 @@ static void create_global_tables_list(int count) {
   }
 }
 
-static void create_global_entries_list(size_t data_file_size) {
-  void *address;
-  unsigned long count;
-  size_t entries_file_size;
-  char filename[40];
-
-  if (global_entries_list == NULL) {
-    global_entries_list = (freelist_t *)malloc(sizeof(freelist_t));
-    if (__glibc_unlikely(global_entries_list == NULL)) {
-      handle_error("malloc");
-    }
-    pthread_mutex_init(&global_entries_list->mutex, NULL);
-    count = data_file_size >> PAGE_SHIFT;
-    entries_file_size = count * sizeof(log_entry_t);
-    sprintf(filename, ENTRIES_PATH, pmem_path, libnvmmio_pid);
-    address = map_logfile(filename, entries_file_size);
-    global_entries_list->head =
-        create_list(address, sizeof(log_entry_t), count, NULL);
-    global_entries_list->count = count;
-    init_entries_lock(global_entries_list->head);
+/**
+ * @brief 在log node上创建entries.log，初始只映射一个chunk，之后按需扩展
+ */
+static void create_global_entries_list(int node, size_t data_file_size) {
+  char filename[LOG_PATH_SIZE];
+  freelist_t *list;
+
+  sprintf(filename, ENTRIES_PATH, pmem_paths[node], libnvmmio_pid);
+  list = create_global_list(filename, sizeof(log_record_t),
+                            data_file_size >> PAGE_SHIFT);
+
+  /* shadow entry只在DRAM中，按需分配物理内存 */
+  list->shadow = (log_entry_t *)mmap(
+      0, list->limit * sizeof(log_entry_t), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (__glibc_unlikely(list->shadow == MAP_FAILED)) {
+    handle_error("mmap");
   }
+  global_entries_list[node] = list;
+  grow_global_entries_list(node);
 }
 
-static void create_global_data_list(size_t data_file_size) {
-  void *address;
-  unsigned long count;
-  size_t log_size;
-  char filename[40];
+/**
+ * @brief 在log node上为不同size的data创建log文件，初始只映射一个chunk，
+ * 之后按需扩展
+ */
+static void create_global_data_list(int node, size_t data_file_size) {
+  char filename[LOG_PATH_SIZE];
+  unsigned long limit;
   int i;
 
-  /* 为不同size的data分配空间 */
   for (i = 0; i < NR_LOG_SIZES; i++) {
-    global_data_list[i] = (freelist_t *)malloc(sizeof(freelist_t));
-    if (__glibc_unlikely(global_data_list[i] == NULL)) {
-      handle_error("malloc");
+    /* 块号必须能放进log record */
+    limit = data_file_size >> DATA_SHIFT(i);
+    if (limit > (1UL << LOG_RECORD_BLOCK_BITS)) {
+      limit = 1UL << LOG_RECORD_BLOCK_BITS;
     }
-    pthread_mutex_init(&global_data_list[i]->mutex, NULL);
 
-    sprintf(filename, DATA_PATH, pmem_path, libnvmmio_pid, i);
-    address = map_logfile(filename, data_file_size);
-    log_size = 1UL << LOG_SHIFT(i);
-    count = data_file_size >> LOG_SHIFT(i);
-    global_data_list[i]->head = create_list(address, log_size, count, NULL);
-    global_data_list[i]->count = count;
+    sprintf(filename, DATA_PATH, pmem_paths[node], libnvmmio_pid, i);
+    global_data_list[node][i] =
+        create_global_list(filename, DATA_SIZE(i), limit);
+    grow_global_data_list(node, i);
   }
 }
 
 static void create_global_umas_list(void) {
   size_t len;
-  void *addr;
-  char filename[40];
+  char filename[LOG_PATH_SIZE];
+  unsigned long i;
 
-  global_uma_list = (freelist_t *)malloc(sizeof(freelist_t));
-  if (__glibc_unlikely(global_uma_list == NULL)) {
-    handle_error("malloc");
-  }
-  pthread_mutex_init(&global_uma_list->mutex, NULL);
   len = MAX_NR_UMAS * sizeof(uma_t);
-  sprintf(filename, UMAS_PATH, pmem_path, libnvmmio_pid);
-  addr = map_logfile(filename, len);
-  global_uma_list->head = create_list(addr, sizeof(uma_t), MAX_NR_UMAS, NULL);
-  global_uma_list->count = MAX_NR_UMAS;
+  sprintf(filename, UMAS_PATH, pmem_paths[0], libnvmmio_pid);
+  umas_base = (uma_t *)map_logfile(filename, len);
+
+  for (i = 0; i < MAX_NR_UMAS; i++) {
+    global_umas[i] = MAX_NR_UMAS - 1 - i;
+  }
+  nr_global_umas = MAX_NR_UMAS;
+}
+
+/**
+ * @brief 为applied.log预留地址空间，每个uma的槽位在nvmmap时才分配
+ */
+static void create_applied_log(void) {
+  char filename[LOG_PATH_SIZE];
+
+  sprintf(filename, APPLIED_PATH, pmem_paths[0], libnvmmio_pid);
+  applied_fd = open_logfile(filename);
+  applied_base = (unsigned long *)reserve_address(
+      MAX_NR_UMAS * UMA_MAX_TABLES * sizeof(unsigned long));
+}
+
+static void create_commit_log(void) {
+  char filename[LOG_PATH_SIZE];
+
+  sprintf(filename, COMMIT_PATH, pmem_paths[0], libnvmmio_pid);
+  commit_record = (commit_record_t *)map_logfile(filename, sizeof(commit_record_t));
 }
 
-static inline void alloc_list(freelist_t **list) {
+static inline void alloc_local_list(local_list_t **list) {
   if (*list == NULL) {
-    *list = (freelist_t *)malloc(sizeof(freelist_t));
+    *list = (local_list_t *)malloc(sizeof(local_list_t));
 
     if (__glibc_unlikely(*list == NULL)) {
       handle_error("malloc");
     }
-    (*list)->head = NULL;
     (*list)->count = 0;
   }
 }
 
-static inline void alloc_local_entries_list(void) {
-  if (local_entries_list == NULL) {
-    local_entries_list = (freelist_t *)malloc(sizeof(freelist_t));
+/**
+ * @brief 调用线程的log node，线程第一次分配时按所在的NUMA node确定
+ * 之后不再改变，保证线程预留的entry和data块来自同一个log node
+ */
+int get_local_log_node(void) {
+  unsigned int cpu, node;
 
-    if (__glibc_unlikely(local_entries_list == NULL)) {
-      handle_error("malloc for local_entries_list");
+  if (__glibc_unlikely(local_node < 0)) {
+    if (getcpu(&cpu, &node) != 0) {
+      node = 0;
     }
-    local_entries_list->head = NULL;
-    local_entries_list->count = 0;
+    local_node = node % nr_log_nodes;
   }
+  return local_node;
 }
 
-static inline void alloc_local_data_list(log_size_t log_size) {
-  if (local_data_list[log_size] == NULL) {
-    local_data_list[log_size] = (freelist_t *)malloc(sizeof(freelist_t));
+/* 只有一个log node时不需要比较 */
+static int get_entry_node(log_entry_t *entry) {
+  freelist_t *list;
+  int node;
 
-    if (__glibc_unlikely(local_data_list[log_size] == NULL)) {
-      handle_error("malloc for local_data_list");
+  for (node = 0; node < nr_log_nodes - 1; node++) {
+    list = global_entries_list[node];
+    if (entry >= list->shadow && entry < list->shadow + list->limit) {
+      break;
     }
-    local_data_list[log_size]->head = NULL;
-    local_data_list[log_size]->count = 0;
   }
+  return node;
 }
 
-static void fill_local_tables_list(void) {
-  list_node_t *node;
-  unsigned long count, i;
-  int s;
+static int get_data_node(void *data, log_size_t log_size) {
+  freelist_t *list;
+  int node;
 
-  s = pthread_mutex_lock(&global_tables_list->mutex);
-  if (__glibc_unlikely(s != 0)) {
-    handle_error("pthread_mutex_lock");
+  for (node = 0; node < nr_log_nodes - 1; node++) {
+    list = global_data_list[node][log_size];
+    if (data >= list->base && data < list->base + list->limit * list->block_size) {
+      break;
+    }
   }
+  return node;
+}
 
-  count = global_tables_list->count;
-
-  if (count == 0) {
-    fill_global_tables_list(false);
-    count = global_tables_list->count;
-  }
+/**
+ * @brief 唤醒后台线程补充global tables list
+ */
+static void wakeup_background_table_alloc(void) {
+  int s;
 
-  if (count > NR_FILL_NODES) {
-    count = NR_FILL_NODES;
+  s = pthread_mutex_lock(&background_table_alloc_mutex);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_mutex_lock");
   }
 
-  node = global_tables_list->head;
-  local_tables_list->head = node;
+  background_table_alloc = true;
 
-  for (i = 0; i < count - 1; i++) {
-    node = node->next;
+  s = pthread_mutex_unlock(&background_table_alloc_mutex);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_mutex_unlock");
   }
-  global_tables_list->head = node->next;
-  node->next = NULL;
-
-  global_tables_list->count -= count;
-  local_tables_list->count += count;
-
-  if (global_tables_list->count < MAX_FREE_NODES) {
-    s = pthread_mutex_lock(&background_table_alloc_mutex);
-    if (__glibc_unlikely(s != 0)) {
-      handle_error("pthread_mutex_lock");
-    }
-
-    background_table_alloc = true;
-
-    s = pthread_mutex_unlock(&background_table_alloc_mutex);
-    if (__glibc_unlikely(s != 0)) {
-      handle_error("pthread_mutex_unlock");
-    }
 
-    s = pthread_cond_signal(&background_table_alloc_cond);
-    if (__glibc_unlikely(s != 0)) {
-      handle_error("pthread_cond_signal");
-    }
+  s = pthread_cond_signal(&background_table_alloc_cond);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_cond_signal");
   }
-
-  pthread_mutex_unlock(&global_tables_list->mutex);
 }
 
-static void fill_local_entries_list(void) {
-  list_node_t *node;
-  unsigned long nrnodes, i;
-
-  pthread_mutex_lock(&global_entries_list->mutex);
-
-  nrnodes = global_entries_list->count;
-
-  if (__glibc_unlikely(nrnodes == 0)) {
-    handle_error("global_entries_list does not have anything");
+static void fill_local_tables_list(int node) {
+  /* 后台线程来不及补充时自己映射 */
+  while (!get_magazine(global_tables_list[node], local_tables_list)) {
+    fill_global_tables_list(node);
   }
 
-  if (nrnodes > NR_FILL_NODES) {
-    nrnodes = NR_FILL_NODES;
+  if (global_tables_list[node]->count < MAX_FREE_NODES &&
+      !background_table_alloc) {
+    wakeup_background_table_alloc();
   }
-
-  node = global_entries_list->head;
-  local_entries_list->head = node;
-
-  for (i = 0; i < nrnodes - 1; i++) {
-    node = node->next;
-  }
-  global_entries_list->head = node->next;
-  node->next = NULL;
-
-  global_entries_list->count -= nrnodes;
-  local_entries_list->count += nrnodes;
-
-  pthread_mutex_unlock(&global_entries_list->mutex);
 }
 
-static void fill_local_data_list(log_size_t log_size) {
-  list_node_t *node;
-  unsigned long count, i;
-
-  pthread_mutex_lock(&global_data_list[log_size]->mutex);
-
-  count = global_data_list[log_size]->count;
-
-  if (__glibc_unlikely(count == 0)) {
-    handle_error("global_data_list does not have anything");
+/**
+ * @brief 从global list取一个magazine，为空时才持锁扩展log文件
+ * 已达上限时等待同步线程回收，超时后才报错
+ */
+static void fill_local_entries_list(int node) {
+  freelist_t *global_list = global_entries_list[node];
+  unsigned long waited = 0;
+  bool grown;
+
+  while (!get_magazine(global_list, local_entries_list[node])) {
+    pthread_mutex_lock(&global_list->mutex);
+    /* 等锁期间其它线程可能已经扩展过了 */
+    grown = __atomic_load_n(&global_list->count, __ATOMIC_RELAXED) ||
+            grow_global_entries_list(node);
+    pthread_mutex_unlock(&global_list->mutex);
+
+    if (!grown && !wait_for_log_space(&waited)) {
+      handle_error("global_entries_list does not have anything");
+    }
   }
+}
 
-  if (count > NR_FILL_NODES) {
-    count = NR_FILL_NODES;
-  }
+static void fill_local_data_list(int node, log_size_t log_size) {
+  freelist_t *global_list = global_data_list[node][log_size];
+  unsigned long waited = 0;
+  bool grown;
 
-  node = global_data_list[log_size]->head;
-  local_data_list[log_size]->head = node;
+  while (!get_magazine(global_list, local_data_list[node][log_size])) {
+    pthread_mutex_lock(&global_list->mutex);
+    grown = __atomic_load_n(&global_list->count, __ATOMIC_RELAXED) ||
+            grow_global_data_list(node, log_size);
+    pthread_mutex_unlock(&global_list->mutex);
 
-  for (i = 0; i < count - 1; i++) {
-    node = node->next;
+    if (!grown && !wait_for_log_space(&waited)) {
+      handle_error("global_data_list does not have anything");
+    }
   }
-  global_data_list[log_size]->head = node->next;
-  node->next = NULL;
-
-  global_data_list[log_size]->count -= count;
-  local_data_list[log_size]->count += count;
-
-  pthread_mutex_unlock(&global_data_list[log_size]->mutex);
 }
 
-/* 将释放的data块重新插入到链中 */
-static void put_log_global(freelist_t *local_list, freelist_t *global_list,
-                           int nrnodes) {
-  list_node_t *node, *tmp_node;
-  int i;
-
-  node = local_list->head;
-  for (i = 1; i < nrnodes; i++) {
-    node = node->next;
-  }
-
-  pthread_mutex_lock(&global_list->mutex);
-
-  tmp_node = local_list->head;
-  local_list->head = node->next;
-  node->next = global_list->head;
-  global_list->head = tmp_node;
-  global_list->count += nrnodes;
+/* 将local list栈顶的nrnodes个块作为一个magazine放回global list */
+static void put_log_global(local_list_t *local_list, freelist_t *global_list,
+                           unsigned long nrnodes) {
   local_list->count -= nrnodes;
-
-  pthread_mutex_unlock(&global_list->mutex);
+  push_magazine(global_list, &local_list->blocks[local_list->count], nrnodes);
 }
 
-/* 将释放的entry和data重新插入到链中 */
-static void put_log_local(log_entry_t *entry, log_size_t log_size) {
-  list_node_t *data_node, *entry_node;
-
-  data_node = alloc_list_node();
-  data_node->ptr = entry->data;
+/* 释放的块放进本线程中所属log node的list */
+static void put_data_local(void *data, log_size_t log_size) {
+  int node = get_data_node(data, log_size);
+  freelist_t *global_list = global_data_list[node][log_size];
+  local_list_t *local_list;
 
-  if (local_data_list[log_size] == NULL) {
-    alloc_local_data_list(log_size);
+  if (local_data_list[node][log_size] == NULL) {
+    alloc_local_list(&local_data_list[node][log_size]);
   }
+  local_list = local_data_list[node][log_size];
 
-  data_node->next = local_data_list[log_size]->head;
-  local_data_list[log_size]->head = data_node;
-
-  local_data_list[log_size]->count += 1;
+  local_list->blocks[local_list->count++] =
+      (data - global_list->base) >> DATA_SHIFT(log_size);
 
-  if (local_data_list[log_size]->count > MAX_FREE_NODES) {
-    put_log_global(local_data_list[log_size], global_data_list[log_size],
-                   NR_FILL_NODES);
+  if (local_list->count > MAX_FREE_NODES) {
+    put_log_global(local_list, global_list, NR_FILL_NODES);
   }
+}
 
-  entry_node = alloc_list_node();
-  entry_node->ptr = entry;
+/* 将释放的entry和data放回本线程的list */
+static void put_log_list(log_entry_t *entry, void *data, log_size_t log_size) {
+  int node = get_entry_node(entry);
+  local_list_t *local_list;
 
-  if (local_entries_list == NULL) {
-    alloc_list(&local_entries_list);
-  }
+  put_data_local(data, log_size);
 
-  entry_node->next = local_entries_list->head;
-  local_entries_list->head = entry_node;
+  if (local_entries_list[node] == NULL) {
+    alloc_local_list(&local_entries_list[node]);
+  }
+  local_list = local_entries_list[node];
 
-  local_entries_list->count += 1;
+  local_list->blocks[local_list->count++] =
+      entry - global_entries_list[node]->shadow;
 
-  if (local_entries_list->count > MAX_FREE_NODES) {
+  if (local_list->count > MAX_FREE_NODES) {
     /* GC */
-    put_log_global(local_entries_list, global_entries_list, NR_FILL_NODES);
+    put_log_global(local_list, global_entries_list[node], NR_FILL_NODES);
   }
 }
 
 uma_t *alloc_uma(void) {
-  list_node_t *node;
   uma_t *uma;
 
-  pthread_mutex_lock(&global_uma_list->mutex);
-  node = global_uma_list->head;
-  global_uma_list->head = node->next;
-  pthread_mutex_unlock(&global_uma_list->mutex);
-
-  uma = node->ptr;
-  free_node(node);
+  pthread_mutex_lock(&global_umas_mutex);
+  if (__glibc_unlikely(nr_global_umas == 0)) {
+    handle_error("too many mappings");
+  }
+  uma = &umas_base[global_umas[--nr_global_umas]];
+  pthread_mutex_unlock(&global_umas_mutex);
 
   if (uma->rwlockp == NULL) {
     uma->rwlockp = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t));
@@ -597,137 +852,268 @@ uma_t *alloc_uma(void) {
 }
 
 void free_uma(uma_t *uma) {
-  list_node_t *node;
+  pthread_mutex_lock(&global_umas_mutex);
+  global_umas[nr_global_umas++] = uma - umas_base;
+  pthread_mutex_unlock(&global_umas_mutex);
+}
 
-  node = alloc_list_node();
-  node->ptr = (void *)uma;
+/**
+ * @brief uma在umas.log中的下标，log record和commit record用它引用uma
+ */
+unsigned long get_uma_index(uma_t *uma) {
+  return uma - umas_base;
+}
 
-  pthread_mutex_lock(&global_uma_list->mutex);
-  node->next = global_uma_list->head;
-  global_uma_list->head = node;
-  pthread_mutex_unlock(&global_uma_list->mutex);
+commit_record_t *get_commit_record(void) {
+  return commit_record;
 }
 
-static void *alloc_log_data(log_size_t log_size) {
-  list_node_t *node;
-  void *data;
+/**
+ * @brief 映射uma在applied.log中的槽位并清零
+ * uma会被复用，旧映射留下的epoch不能让恢复时跳过新映射的record
+ */
+unsigned long *map_uma_applied(uma_t *uma) {
+  unsigned long slot = uma - umas_base;
+  unsigned long *applied;
+  size_t len;
 
-  if (local_data_list[log_size] == NULL) {
-    alloc_local_data_list(log_size);
+  if (__glibc_unlikely(uma->nr_tables > UMA_MAX_TABLES)) {
+    handle_error("the mapping is too large");
   }
 
-  if (local_data_list[log_size]->count == 0) {
-    fill_local_data_list(log_size);
+  len = (uma->nr_tables * sizeof(unsigned long) + PAGE_SIZE - 1) & PAGE_MASK;
+  applied = applied_base + slot * UMA_MAX_TABLES;
+  map_logfile_chunk(applied, applied_fd,
+                    slot * UMA_MAX_TABLES * sizeof(unsigned long), len);
+  pmem_memset_persist(applied, 0, len);
+  return applied;
+}
+
+static void put_log_local(log_entry_t *entry, void *data, log_size_t log_size) {
+  log_reservation_t *reservation = local_reservation[log_size];
+
+  /* 预留中只放本线程log node的entry */
+  if (reservation != NULL && reservation->count < reservation->limit &&
+      get_entry_node(entry) == get_local_log_node()) {
+    entry->data = data;
+    reservation->entries[reservation->count++] = entry;
+    return;
   }
+  put_log_list(entry, data, log_size);
+}
 
-  node = local_data_list[log_size]->head;
-  local_data_list[log_size]->head = node->next;
-  local_data_list[log_size]->count -= 1;
+static void *alloc_log_data(int node, log_size_t log_size) {
+  local_list_t *local_list;
+  unsigned long block;
 
-  if (__glibc_unlikely(node->ptr == NULL)) {
-    handle_error("node->ptr == NULL");
+  if (local_data_list[node][log_size] == NULL) {
+    alloc_local_list(&local_data_list[node][log_size]);
   }
+  local_list = local_data_list[node][log_size];
 
-  data = node->ptr;
-  free_node(node);
+  if (local_list->count == 0) {
+    fill_local_data_list(node, log_size);
+  }
 
-  return data;
+  block = local_list->blocks[--local_list->count];
+  return global_data_list[node][log_size]->base +
+         (block << DATA_SHIFT(log_size));
 }
 
 log_table_t *alloc_log_table(log_table_t *parent, int index,
                              table_type_t type) {
+  int node = get_local_log_node();
   log_table_t *table;
-  list_node_t *node;
 
   if (local_tables_list == NULL) {
-    alloc_list(&local_tables_list);
+    alloc_local_list(&local_tables_list);
   }
 
   if (local_tables_list->count == 0) {
-    fill_local_tables_list();
-  }
-
-  node = local_tables_list->head;
-  local_tables_list->head = node->next;
-  local_tables_list->count -= 1;
-  if (__glibc_unlikely(node->ptr == NULL)) {
-    handle_error("node->ptr == NULL");
+    fill_local_tables_list(node);
   }
 
-  table = node->ptr;
-  free_node(node);
+  table = (log_table_t *)global_tables_list[node]->base +
+          local_tables_list->blocks[--local_tables_list->count];
 
   table->count = 0;
   table->type = type;
   table->parent = parent;
   table->index = index;
   table->log_size = LOG_4K;
+  memset(table->hist, 0, sizeof(table->hist));
+  memset(table->valid, 0, sizeof(table->valid));
+  table->policy = default_table_policy();
+  memset(&table->stats, 0, sizeof(table->stats));
 
   return table;
 }
 
-log_entry_t *alloc_log_entry(uma_t *uma, log_size_t log_size) {
-  log_entry_t *entry;
-  list_node_t *node;
-  int s;
+static log_reservation_t *get_local_reservation(log_size_t log_size) {
+  log_reservation_t *reservation = local_reservation[log_size];
 
-  if (local_entries_list == NULL) {
-    alloc_list(&local_entries_list);
+  if (reservation == NULL) {
+    reservation = (log_reservation_t *)malloc(sizeof(log_reservation_t));
+    if (__glibc_unlikely(reservation == NULL)) {
+      handle_error("malloc for local_reservation");
+    }
+    reservation->count = 0;
+    reservation->limit = LOG_RESERVE_BYTES >> DATA_SHIFT(log_size);
+    if (reservation->limit == 0) {
+      reservation->limit = 1;
+    } else if (reservation->limit > LOG_RESERVE_SIZE) {
+      reservation->limit = LOG_RESERVE_SIZE;
+    }
+    local_reservation[log_size] = reservation;
   }
+  return reservation;
+}
 
-  if (local_entries_list->count == 0) {
-    fill_local_entries_list();
+/**
+ * @brief 为本线程预留至少n个log_size的entry（不超过预留上限）
+ * log空间充足时一次补满，之后的小写入不必再补。
+ * local list不够时按magazine整批从global list补充，
+ * 之后从两个local list的栈顶一次取走所需的entry和data块
+ */
+void reserve_log_entries(log_size_t log_size, unsigned long n) {
+  log_reservation_t *reservation = get_local_reservation(log_size);
+  int node = get_local_log_node();
+  local_list_t *entries_list, *data_list;
+  log_entry_t *shadow, *entry;
+  void *base;
+  unsigned long i, nr;
+
+  if (n > reservation->limit) {
+    n = reservation->limit;
+  }
+  if (reservation->count >= n) {
+    return;
+  }
+  if (get_log_space(log_size) == LOG_SPACE_OK) {
+    n = reservation->limit;
   }
+  nr = n - reservation->count;
 
-  node = local_entries_list->head;
-  local_entries_list->head = node->next;
-  local_entries_list->count -= 1;
+  alloc_local_list(&local_entries_list[node]);
+  alloc_local_list(&local_data_list[node][log_size]);
+  entries_list = local_entries_list[node];
+  data_list = local_data_list[node][log_size];
 
-  if (__glibc_unlikely(node->ptr == NULL)) {
-    handle_error("node->ptr == NULL");
+  /* nr不超过LOG_RESERVE_SIZE，补充一个magazine后local list不会溢出 */
+  while (entries_list->count < nr) {
+    fill_local_entries_list(node);
+  }
+  while (data_list->count < nr) {
+    fill_local_data_list(node, log_size);
   }
 
-  entry = node->ptr;
-  free_node(node);
+  entries_list->count -= nr;
+  data_list->count -= nr;
+  shadow = global_entries_list[node]->shadow;
+  base = global_data_list[node][log_size]->base;
+
+  for (i = 0; i < nr; i++) {
+    entry = &shadow[entries_list->blocks[entries_list->count + i]];
+    entry->data = base + ((unsigned long)data_list->blocks[data_list->count + i]
+                          << DATA_SHIFT(log_size));
+    reservation->entries[reservation->count++] = entry;
+  }
+}
+
+/**
+ * @brief 把预留的entry和data块放回本线程的链表
+ */
+static void release_local_reservation(void) {
+  log_reservation_t *reservation;
+  log_entry_t *entry;
+  void *data;
+  int i;
+
+  for (i = 0; i < NR_LOG_SIZES; i++) {
+    reservation = local_reservation[i];
+    if (reservation == NULL) continue;
+
+    while (reservation->count > 0) {
+      entry = reservation->entries[--reservation->count];
+      data = entry->data;
+      entry->data = NULL;
+      put_log_list(entry, data, i);
+    }
+  }
+}
+
+log_entry_t *alloc_log_entry(uma_t *uma, log_size_t log_size,
+                             log_policy_t policy) {
+  log_reservation_t *reservation = get_local_reservation(log_size);
+  log_entry_t *entry;
+
+  if (reservation->count == 0) {
+    reserve_log_entries(log_size, 1);
+  }
+  entry = reservation->entries[--reservation->count];
 
   entry->epoch = uma->epoch;
   entry->offset = 0;
   entry->len = 0;
-  entry->policy = uma->policy;
+  entry->policy = policy;
   entry->dst = NULL;
-  entry->data = alloc_log_data(log_size);
 
-  s = pthread_rwlock_init(entry->rwlockp, NULL);
-  if (__glibc_unlikely(s != 0)) {
-    handle_error("pthread_rwlock_init");
-  }
+  entry->location = 0;
+  entry->uma = uma - umas_base;
+  entry->log_size = log_size;
+  entry->block = (entry->data - global_data_list[local_node][log_size]->base) >>
+                 DATA_SHIFT(log_size);
+  entry->valid = 1;
 
   return entry;
 }
 
+/**
+ * @brief 给entry换一个log_size大小的data块，返回旧的data块
+ * 新块与entry来自同一个log node，record中的块号才指向正确的data log。
+ * 调用者必须持有entry的版本锁，拷贝完有效数据后用free_log_data释放旧块
+ */
+void *replace_log_data(log_entry_t *entry, log_size_t log_size) {
+  int node = get_entry_node(entry);
+  void *data = entry->data;
+
+  entry->data = alloc_log_data(node, log_size);
+  entry->log_size = log_size;
+  entry->block = (entry->data - global_data_list[node][log_size]->base) >>
+                 DATA_SHIFT(log_size);
+
+  return data;
+}
+
+void free_log_data(void *data, log_size_t log_size) {
+  put_data_local(data, log_size);
+}
+
 /**
  * @brief 把local entry list中的entry node全部释放会local list中
+ * 调用者必须持有entry的版本锁，释放后版本锁也随之释放
  * 
  * @param entry 
- * @param log_size 
  * @param sync 
  */
-void free_log_entry(log_entry_t *entry, log_size_t log_size, bool sync) {
-  int s;
+void free_log_entry(log_entry_t *entry, bool sync) {
+  log_size_t log_size = entry->log_size;
+  void *data = entry->data;
+
   entry->united = 0;
+  entry->location = 0;
   entry->data = NULL;
   entry->dst = NULL;
 
+  /* data块被重用前record必须已经失效，否则恢复时会重放错误的数据 */
   if (sync) {
-    pmem_persist(entry, sizeof(log_entry_t)); /* TODO:查一下这个函数 */
+    pmem_persist(store_log_record(entry), sizeof(log_record_t));
   }
 
-  s = pthread_rwlock_destroy(entry->rwlockp);
-  if (__glibc_unlikely(s != 0)) {
-    handle_error("pthread_rwlock_destroy");
-  }
+  /* 版本号改变，正在乐观读的线程会重读 */
+  unlock_log_entry(entry);
 
-  put_log_local(entry, log_size);
+  put_log_local(entry, data, log_size);
 }
 
 /**
@@ -735,78 +1121,221 @@ void free_log_entry(log_entry_t *entry, log_size_t log_size, bool sync) {
  * 
  */
 void release_local_list(void) {
-  list_node_t *node;
-  unsigned long nrnodes, i;
+  unsigned long nrnodes;
+  int node;
 
-  if (local_entries_list == NULL) {
-    alloc_list(&local_entries_list);
-  }
+  release_local_reservation();
 
-  nrnodes = local_entries_list->count;
+  for (node = 0; node < nr_log_nodes; node++) {
+    if (local_entries_list[node] == NULL) continue;
 
-  if (nrnodes == 0)
-    return;
+    /* 一个magazine最多NR_FILL_NODES个块 */
+    while (local_entries_list[node]->count > 0) {
+      nrnodes = local_entries_list[node]->count;
+      if (nrnodes > NR_FILL_NODES) {
+        nrnodes = NR_FILL_NODES;
+      }
+      put_log_global(local_entries_list[node], global_entries_list[node],
+                     nrnodes);
+    }
+  }
+}
+
+/**
+ * @brief 将本线程缓存的空闲data块全部释放回global list
+ * 同步线程只释放data块而从不分配，缓存在本地的块对写线程不可见
+ */
+void release_local_data_list(void) {
+  local_list_t *local_list;
+  unsigned long nrnodes;
+  int node, i;
+
+  for (node = 0; node < nr_log_nodes; node++) {
+    for (i = 0; i < NR_LOG_SIZES; i++) {
+      local_list = local_data_list[node][i];
+      if (local_list == NULL) continue;
+
+      while (local_list->count > 0) {
+        nrnodes = local_list->count;
+        if (nrnodes > NR_FILL_NODES) {
+          nrnodes = NR_FILL_NODES;
+        }
+        put_log_global(local_list, global_data_list[node][i], nrnodes);
+      }
+    }
+  }
+}
 
-  node = local_entries_list->head;
+static inline log_space_t freelist_space(freelist_t *list) {
+  unsigned long count = free_blocks(list);
 
-  for (i = 0; i < nrnodes - 1; i++) {
-    node = node->next;
+  if (count < list->min_mark) {
+    return LOG_SPACE_MIN;
+  } else if (count < list->low_mark) {
+    return LOG_SPACE_LOW;
   }
+  return LOG_SPACE_OK;
+}
 
-  if (__glibc_unlikely(node->next != NULL)) {
-    handle_error("data_node->next is not NULL");
+/**
+ * @brief 根据global list中剩余的空闲entry和data块判断log空间压力
+ * 不加锁读取count，结果只用于同步和限流的节奏控制；
+ * 有多个log node时取压力最大的一个
+ *
+ * @param log_size 需要检查的data块大小，NR_LOG_SIZES表示检查所有大小
+ */
+log_space_t get_log_space(log_size_t log_size) {
+  log_space_t space, ret = LOG_SPACE_OK;
+  int node, i;
+
+  for (node = 0; node < nr_log_nodes; node++) {
+    space = freelist_space(global_entries_list[node]);
+    if (space > ret) {
+      ret = space;
+    }
+
+    for (i = 0; i < NR_LOG_SIZES; i++) {
+      if (log_size != NR_LOG_SIZES && log_size != (log_size_t)i) {
+        continue;
+      }
+
+      space = freelist_space(global_data_list[node][i]);
+      if (space > ret) {
+        ret = space;
+      }
+    }
   }
+  return ret;
+}
 
-  pthread_mutex_lock(&global_entries_list->mutex);
+/**
+ * @brief 在每个PMEM根目录下创建本进程的log目录并持有它的flock
+ */
+static void create_log_dir(int node) {
+  char dirpath[LOG_PATH_SIZE];
+  int s;
 
-  node->next = global_entries_list->head;
-  global_entries_list->head = local_entries_list->head;
-  local_entries_list->head = NULL;
-  global_entries_list->count += nrnodes;
-  local_entries_list->count -= nrnodes;
+  sprintf(dirpath, DIR_PATH, pmem_paths[node], libnvmmio_pid);
+  s = mkdir(dirpath, 0700);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("mkdir");
+  }
 
-  if (__glibc_unlikely(local_entries_list->count != 0)) {
-    handle_error("local_entries_list->nrnodes != 0");
+  /* 进程退出(包括崩溃)时flock自动释放，恢复时据此判断目录是否已被遗弃 */
+  log_dir_fds[node] = open(dirpath, O_RDONLY | O_DIRECTORY);
+  if (__glibc_unlikely(log_dir_fds[node] == -1)) {
+    handle_error("open");
+  }
+  s = flock(log_dir_fds[node], LOCK_EX);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("flock");
   }
+}
+
+/**
+ * @brief 在log目录中记录本进程使用的全部PMEM根目录，每行一个，第0个保存元数据
+ * 恢复时按它找到各log node的目录，不依赖恢复时的PMEM_PATH
+ */
+static void write_log_nodes(int node) {
+  char filename[LOG_PATH_SIZE];
+  int fd, i;
+
+  sprintf(filename, NODES_PATH, pmem_paths[node], libnvmmio_pid);
+  fd = open_logfile(filename);
 
-  pthread_mutex_unlock(&global_entries_list->mutex);
+  for (i = 0; i < nr_log_nodes; i++) {
+    if (__glibc_unlikely(dprintf(fd, "%s\n", pmem_paths[i]) < 0)) {
+      handle_error("dprintf");
+    }
+  }
+  if (__glibc_unlikely(fsync(fd) != 0)) {
+    handle_error("fsync");
+  }
+  close(fd);
 }
 
+/**
+ * @brief 解析PMEM_PATH
+ * PMEM_PATH可以是用':'分隔的多个路径，第i个路径是NUMA node i上的PMEM，
+ * 各自保存一套entries和data log；uma等元数据只放在第0个路径下
+ */
 void init_env(void) {
-  char dirpath[40];
+  char *env, *path, *saveptr;
   size_t len;
-	int s;
+  int node;
 
-  pmem_path = getenv("PMEM_PATH");
-  if (__glibc_unlikely(pmem_path == NULL)) {
+  env = getenv("PMEM_PATH");
+  if (__glibc_unlikely(env == NULL)) {
     handle_error("PMEM_PATH is NULL.");
   }
 
-  len = strlen(pmem_path);
+  env = strdup(env);
+  if (__glibc_unlikely(env == NULL)) {
+    handle_error("strdup");
+  }
 
-  if (pmem_path[len - 1] == '/') {
-    pmem_path[len - 1] = '\0';
+  for (path = strtok_r(env, ":", &saveptr);
+       path != NULL && nr_log_nodes < MAX_NR_LOG_NODES;
+       path = strtok_r(NULL, ":", &saveptr)) {
+    len = strlen(path);
+    if (len > 1 && path[len - 1] == '/') {
+      path[len - 1] = '\0';
+    }
+    if (__glibc_unlikely(strlen(path) >= LOG_ROOT_SIZE)) {
+      handle_error_en(ENAMETOOLONG, path);
+    }
+    pmem_paths[nr_log_nodes++] = path;
+  }
+  if (__glibc_unlikely(nr_log_nodes == 0)) {
+    handle_error("PMEM_PATH is empty.");
   }
 
   libnvmmio_pid = getpid();
-	
-	sprintf(dirpath, DIR_PATH, pmem_path, libnvmmio_pid);
-	s = mkdir(dirpath, 0700);
-	if (__glibc_unlikely(s != 0)) {
-		handle_error("mkdir");
-	}
+
+  for (node = 0; node < nr_log_nodes; node++) {
+    create_log_dir(node);
+  }
+  /* 所有目录都创建之后才写入，恢复时有nodes.log的目录一定都存在 */
+  for (node = 0; node < nr_log_nodes; node++) {
+    write_log_nodes(node);
+  }
+}
+
+/**
+ * @brief 第node个PMEM根目录，第0个保存uma等元数据
+ */
+const char *get_pmem_path(int node) {
+  return pmem_paths[node];
+}
+
+int get_nr_log_nodes(void) {
+  return nr_log_nodes;
 }
 
 void init_global_freelist(void) {
+  int node;
+
   create_global_tables_list(MAX_FREE_NODES * 10);
-  create_global_entries_list(LOG_FILE_SIZE * 2);
-  create_global_data_list(LOG_FILE_SIZE);
+  for (node = 0; node < nr_log_nodes; node++) {
+    create_global_entries_list(node, LOG_FILE_SIZE * 2);
+    create_global_data_list(node, LOG_FILE_SIZE);
+  }
   create_global_umas_list();
+  create_applied_log();
+  create_commit_log();
 }
 
+/**
+ * @brief 先删除保存元数据的目录，之后其它目录即使残留也不会被恢复，只会被删除
+ */
 void cleanup_logs(void) {
-	char log_dir[1024];
-	sprintf(log_dir, DIR_PATH, pmem_path, libnvmmio_pid);
-	rmlogs(log_dir);
+	char log_dir[LOG_PATH_SIZE];
+  int node;
+
+  for (node = 0; node < nr_log_nodes; node++) {
+    sprintf(log_dir, DIR_PATH, pmem_paths[node], libnvmmio_pid);
+    rmlogs(log_dir);
+    close(log_dir_fds[node]);
+  }
 	LIBNVMMIO_DEBUG("removed logs");
 }
@@ -7,27 +7,88 @@
 #include "radixlog.h"
 #include "uma.h"
 
-typedef struct list_node_struct {
-  struct list_node_struct *next;
-  void *ptr;
-} list_node_t;
+#define LOG_DIR_PREFIX ".libnvmmio-"
+#define DIR_PATH "%s/.libnvmmio-%lu"
+#define DATA_PATH "%s/.libnvmmio-%lu/data-%d.log"
+#define ENTRIES_PATH "%s/.libnvmmio-%lu/entries.log"
+#define UMAS_PATH "%s/.libnvmmio-%lu/umas.log"
+#define APPLIED_PATH "%s/.libnvmmio-%lu/applied.log"
+#define COMMIT_PATH "%s/.libnvmmio-%lu/commit.log"
+#define NODES_PATH "%s/.libnvmmio-%lu/nodes.log"
+#define LOG_PATH_SIZE (256)
+#define LOG_ROOT_SIZE (LOG_PATH_SIZE / 2) /* 根目录加上log文件名不超过LOG_PATH_SIZE */
+#define MAX_NR_LOG_NODES (8) /* PMEM_PATH中最多的路径数 */
+
+/* applied.log中每个uma预留的table个数，与log record中page的位数对应 */
+#define UMA_MAX_TABLES (1UL << (LOG_RECORD_PAGE_BITS + PAGE_SHIFT - TABLE_SHIFT))
+
+#define LOG_LOW_WATERMARK (25) /* 空闲log空间低于25%时加速同步 */
+#define LOG_MIN_WATERMARK (10) /* 空闲log空间低于10%时限制写线程 */
+
+typedef enum {
+  LOG_SPACE_OK,
+  LOG_SPACE_LOW,
+  LOG_SPACE_MIN
+} log_space_t;
+
+/**
+ * @brief 组提交的record，持久化在commit.log中
+ * csum匹配时整组提交生效，恢复时把其中每个uma的epoch至少提高到记录的值；
+ * id不同说明uma已被复用，忽略该项
+ */
+typedef struct commit_record_struct {
+  unsigned long csum; /* 覆盖seq、nr和entries[0, nr) */
+  unsigned long seq;
+  unsigned long nr;
+  struct {
+    unsigned long uma; /* umas.log中的下标 */
+    unsigned long id;
+    unsigned long epoch;
+  } entries[MAX_NR_UMAS];
+} commit_record_t;
+
+static inline unsigned long commit_record_csum(const commit_record_t *record) {
+  const unsigned long *p = &record->seq;
+  unsigned long n, csum = 0xcbf29ce484222325UL;
+
+  if (record->nr > MAX_NR_UMAS) {
+    return ~record->csum;
+  }
+  n = (sizeof(record->entries[0]) * record->nr) / sizeof(unsigned long) + 2;
+
+  while (n--) {
+    csum = (csum ^ *p++) * 0x100000001b3UL;
+  }
+  return csum;
+}
 
 typedef struct free_table_struct {
   unsigned long count;
   struct log_table_struct **table_array;
 } free_tables_t;
 
-struct list_node_struct *alloc_list_node(void);
 struct mmap_area_struct *alloc_uma(void);
 void free_uma(struct mmap_area_struct *uma);
+unsigned long *map_uma_applied(struct mmap_area_struct *uma);
+unsigned long get_uma_index(struct mmap_area_struct *uma);
+commit_record_t *get_commit_record(void);
 struct log_table_struct *alloc_log_table(struct log_table_struct *parent,
                                          int index, enum table_type_enum);
 struct log_entry_struct *alloc_log_entry(struct mmap_area_struct *uma,
-                                         log_size_t log_size);
-void free_log_entry(struct log_entry_struct *entry, log_size_t log_size,
-                    bool sync);
+                                         log_size_t log_size,
+                                         log_policy_t policy);
+void reserve_log_entries(log_size_t log_size, unsigned long n);
+void *replace_log_data(struct log_entry_struct *entry, log_size_t log_size);
+void free_log_data(void *data, log_size_t log_size);
+void free_log_entry(struct log_entry_struct *entry, bool sync);
 void release_local_list(void);
+void release_local_data_list(void);
+log_space_t get_log_space(log_size_t log_size);
 void init_env(void);
+int get_local_log_node(void);
+const char *get_pmem_path(int node);
+int get_nr_log_nodes(void);
+void rmlogs(const char *path);
 void init_global_freelist(void);
 
 void exit_background_table_alloc_thread(void);
@@ -15,7 +15,6 @@ const char *func_name[NR_FUNCS] = {
     "nvmmio_memcpy",
     "get_fd_uma",
     "increase_uma_write_cnt",
-    "increase_uma_read_cnt",
     "nvmmio_fence",
     "nvmmio_write",
     "nvmmio_flush",
@@ -14,7 +14,6 @@ enum time_category {
   nvmmio_memcpy_t,
   get_fd_uma_t,
   increase_uma_write_cnt_t,
-  increase_uma_read_cnt_t,
   nvmmio_fence_t,
   nvmmio_write_t,
   nvmmio_flush_t,
@@ -29,9 +29,14 @@ typedef enum log_size_enum {
   LOG_512K,
   LOG_1M,
   LOG_2M,
-  NR_LOG_SIZES /* 10 */
+  LOG_64B,  /* 小于一页的data块，只用于LOG_4K的table中的小写 */
+  LOG_256B,
+  LOG_1K,
+  NR_LOG_SIZES /* 13 */
 } log_size_t;
 
+#define NR_TABLE_LOG_SIZES (LOG_2M + 1) /* table可以使用的log_size */
+
 typedef enum table_type_enum {
   LGD = (PTRS_PER_TABLE * PTRS_PER_TABLE * PTRS_PER_TABLE),
   LUD = (PTRS_PER_TABLE * PTRS_PER_TABLE),
@@ -50,8 +55,17 @@ typedef enum table_type_enum {
 #define LOG_OFFSET(addr, s) (addr & (LOG_SIZE(s) - 1))
 #define NUM_ENTRIES(s) (1UL << (LMD_SHIFT - LOG_SHIFT(s)))
 
+/* data块的大小，小于一页的data块只覆盖页内按块大小对齐的一段(window) */
+#define IS_SUBPAGE_LOG(s) ((s) > LOG_2M)
+#define DATA_SHIFT(s) \
+  (IS_SUBPAGE_LOG(s) ? 6 + (((s) - LOG_64B) << 1) : LOG_SHIFT(s))
+#define DATA_SIZE(s) (1UL << DATA_SHIFT(s))
+#define DATA_WINDOW(s, offset) \
+  (IS_SUBPAGE_LOG(s) ? (offset) & ~(DATA_SIZE(s) - 1) : 0)
+
 #define MAX_FREE_NODES (1UL << 11)          /* 2048 */
 #define NR_FILL_NODES (MAX_FREE_NODES >> 1) /* 1024 */
-#define LOG_FILE_SIZE (1UL << 32)
+#define LOG_FILE_SIZE (1UL << 32)           /* 每个log文件的上限 */
+#define LOG_CHUNK_SIZE (1UL << 26)          /* log文件每次扩展64MB */
 
 #endif /* _LIBNVMMIO_INTERNAL_H */
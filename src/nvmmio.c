@@ -5,6 +5,7 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
@@ -17,31 +18,30 @@
 #include "allocator.h"
 #include "internal.h"
 #include "list.h"
+#include "policy.h"
+#include "recovery.h"
+#include "sync.h"
 #include "debug.h"
 
 //#define O_ATOMIC 01000000000
 //#define _USE_HYBRID_LOGGING
-#define HYBRID_WRITE_RATIO (40)
 #define MIN_FILESIZE (1UL << 26)
+#define NVMSYNC_SLICE_ENTRIES (1024) /* 并行写回时每段至少包含的entry个数 */
 
 static inline void nvmmio_fence(void);
 static inline void nvmmio_write(void *, const void *, size_t, bool);
 static inline void nvmmio_flush(const void *, size_t, bool);
 static inline void atomic_decrease(int *);
 static inline void init_base_address(void);
-static void sync_uma(uma_t *);
 static void cleanup_handler(void);
 static inline void *get_base_mmap_addr(void *, size_t);
 static inline bool filter_addr(const void *);
-static void *sync_thread_func(void *);
-static void create_sync_thread(uma_t *);
 static inline int check_overwrite(void *, void *, void *, void *);
 static inline log_size_t set_log_size(size_t);
-static void nvmsync_sync(void *, size_t, unsigned long);
-static inline void nvmemcpy_f2f_write(void *, const void *, size_t, uma_t *, uma_t *);
+static void nvmsync_sync(void *, size_t, unsigned long, uma_t *);
+static void release_retired_log_data(uma_t *);
+static inline void nvmemcpy_f2f_write(void *, const void *, size_t, uma_t *);
 
-static size_t nvstrlen_redo(char *, char *, bool *);
-static void get_string_from_redo(char **, const char *);
 
 static bool initialized = false;
 static void *base_mmap_addr = NULL;
@@ -132,23 +132,302 @@ static inline void init_base_address(void) {
     }
 
     /* 这能够实现啥？ */
-    base_mmap_addr = (void *)(addr - (1UL << 38)); /* 256 GB */
+    base_mmap_addr = (void *)(addr - UMA_WINDOW_SIZE); /* 256 GB */
     base_mmap_addr = ALIGN_TABLE((base_mmap_addr + TABLE_SIZE));
     munmap(addr, PAGE_SIZE);
   }
 }
 
 /**
- * @brief 用后台线程调用，进行sync
+ * @brief lease期间被替换下来的data块，所有lease释放后才归还
  */
-static void sync_uma(uma_t *uma) {
-  unsigned long address, current_epoch, end, i;
-  unsigned long table_size = 1UL << 21;
-  unsigned long nrlogs;
-  log_table_t *table;
-  log_entry_t *entry;
+typedef struct retired_data_struct {
+  struct retired_data_struct *next;
+  void *data;
   log_size_t log_size;
+} retired_data_t;
+
+static inline bool is_uma_leased(uma_t *uma) {
+  return __atomic_load_n(&uma->nr_leases, __ATOMIC_SEQ_CST) > 0;
+}
+
+static void push_retired_log_data(uma_t *uma, retired_data_t *head,
+                                  retired_data_t *tail) {
+  do {
+    tail->next = uma->retired;
+  } while (!__sync_bool_compare_and_swap(&uma->retired, tail->next, head));
+}
+
+/**
+ * @brief 有lease时data块可能仍被span引用，先挂到uma上
+ */
+static void retire_log_data(uma_t *uma, void *data, log_size_t log_size) {
+  retired_data_t *node;
+
+  node = malloc(sizeof(retired_data_t));
+  if (__glibc_unlikely(node == NULL)) {
+    handle_error("malloc");
+  }
+  node->data = data;
+  node->log_size = log_size;
+  push_retired_log_data(uma, node, node);
+}
+
+/**
+ * @brief 归还lease期间被替换下来的data块
+ * 取下链表之后仍有lease时放回，这些块可能被新的lease之前的span引用
+ */
+static void release_retired_log_data(uma_t *uma) {
+  retired_data_t *node, *tail, *next;
+
+  if (uma->retired == NULL) return;
+
+  node = __atomic_exchange_n(&uma->retired, NULL, __ATOMIC_SEQ_CST);
+  if (node == NULL) return;
+
+  if (is_uma_leased(uma)) {
+    for (tail = node; tail->next != NULL; tail = tail->next)
+      ;
+    push_retired_log_data(uma, node, tail);
+    return;
+  }
+
+  while (node != NULL) {
+    next = node->next;
+    free_log_data(node->data, node->log_size);
+    free(node);
+    node = next;
+  }
+}
+
+/**
+ * @brief 持有lease期间同步线程不释放该uma的log entry
+ */
+void pin_uma_logs(uma_t *uma) {
+  __atomic_add_fetch(&uma->nr_leases, 1, __ATOMIC_SEQ_CST);
+}
+
+void unpin_uma_logs(uma_t *uma) {
+  if (__atomic_sub_fetch(&uma->nr_leases, 1, __ATOMIC_SEQ_CST) == 0) {
+    release_retired_log_data(uma);
+
+    /* lease期间被跳过的已提交entry和等待者交给同步线程 */
+    if (is_uma_dirty(uma) || has_sync_waiters(uma)) {
+      enqueue_sync_uma(uma);
+    }
+  }
+}
+
+/**
+ * @brief 持久化table已写回到的epoch，只增不减
+ */
+static void persist_table_applied(uma_t *uma, unsigned long table_addr,
+                                  unsigned long epoch) {
+  unsigned long *applied, old, base;
+
+  /* 与dirty table位图一样从对齐的table起算，start不一定按2MB对齐 */
+  base = (unsigned long)ALIGN_TABLE(uma->start);
+  applied = &uma->applied[(table_addr - base) >> TABLE_SHIFT];
+  old = __atomic_load_n(applied, __ATOMIC_RELAXED);
+  while (old < epoch &&
+         !__atomic_compare_exchange_n(applied, &old, epoch, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  nvmmio_flush(applied, sizeof(unsigned long), true);
+}
+
+/**
+ * @brief 将table中[first, last]内已提交的log entry写回映射文件并释放
+ * 分两个阶段：先写回全部entry，只drain一次；再持久化table的applied epoch，
+ * 恢复时跳过epoch不大于它的REDO record。record的失效因此不必立即drain，
+ * 由调用者在整轮检查点结束时drain一次
+ *
+ * @param wait 为true时等待被占用的entry，否则跳过
+ * @return 因被占用而未能处理的已提交entry个数
+ */
+static unsigned long checkpoint_table(log_table_t *table,
+                                      unsigned long table_addr,
+                                      unsigned long first, unsigned long last,
+                                      unsigned long current_epoch, uma_t *uma,
+                                      bool wait) {
+  log_entry_t *synced[PTRS_PER_TABLE];
+  unsigned long index[PTRS_PER_TABLE];
+  unsigned long nrlogs, i, nr = 0, busy = 0;
+  unsigned long min_epoch = current_epoch; /* 留在table中的最早的已提交epoch */
+  unsigned long max_epoch = 0;             /* 被释放的最新的epoch */
+  unsigned long applied, epoch;
+  unsigned int backoff = 0;
+  log_entry_t *entry;
   void *dst, *src;
+
+  nrlogs = NUM_ENTRIES(table->log_size);
+
+  for (i = next_table_entry_valid(table, 0, nrlogs); i < nrlogs;
+       i = next_table_entry_valid(table, i + 1, nrlogs)) {
+  checkpoint_table_get_entry:
+    entry = table->entries[i];
+
+    if (entry == NULL) continue;
+    epoch = log_epoch(entry->epoch, current_epoch);
+    if (epoch >= current_epoch) continue;
+
+    /* 写者只会在写回之后增大entry的epoch，不加锁读到旧值只会更保守 */
+    if (i < first || i > last) {
+      if (epoch < min_epoch) min_epoch = epoch;
+      continue;
+    }
+
+    /* Acquire the writer lock of the log entry */
+    if (!try_lock_log_entry(entry)) {
+      if (wait) {
+        log_lock_backoff(&backoff);
+        goto checkpoint_table_get_entry;
+      }
+      if (epoch < min_epoch) min_epoch = epoch;
+      busy++;
+      continue;
+    }
+    backoff = 0;
+
+    epoch = log_epoch(entry->epoch, current_epoch);
+    if (table->entries[i] != entry || epoch >= current_epoch) {
+      unlock_log_entry(entry);
+      continue;
+    }
+
+    if (entry->policy == REDO) {
+      dst = entry->dst + entry->offset;
+      src = log_entry_start(entry);
+
+      nvmmio_write(dst, src, entry->len, false);
+    }
+
+    /* 加锁之后再检查lease，之后开始的lease读不到这个entry。
+     * 已写回映射文件，留给lease释放后的同步线程回收 */
+    if (__glibc_unlikely(is_uma_leased(uma))) {
+      if (epoch < min_epoch) min_epoch = epoch;
+      unlock_log_entry(entry);
+      busy++;
+      continue;
+    }
+
+    if (epoch > max_epoch) max_epoch = epoch;
+    synced[nr] = entry;
+    index[nr] = i;
+    nr++;
+  }
+
+  if (nr == 0) return busy;
+
+  /* 写回的数据必须先于applied epoch持久化 */
+  nvmmio_fence();
+
+  applied = min_epoch - 1;
+  persist_table_applied(uma, table_addr, applied);
+
+  for (i = 0; i < nr; i++) {
+    table->entries[index[i]] = NULL;
+    clear_table_entry_valid(table, index[i]);
+
+    /* shadow中的log_size在释放时还要用，只清除持久化的record */
+    synced[i]->record->united = 0;
+    synced[i]->record->location = 0;
+    nvmmio_flush(synced[i]->record, sizeof(log_record_t), false);
+  }
+
+  /* 有更早的entry留在table中时applied epoch盖不住被释放的record，
+   * data块被重用前这些record必须已经失效 */
+  if (__glibc_unlikely(max_epoch > applied)) {
+    nvmmio_fence();
+  }
+
+  for (i = 0; i < nr; i++) {
+    free_log_entry(synced[i], false);
+    atomic_decrease(&table->count);
+  }
+  return busy;
+}
+
+/**
+ * @brief 将table中已提交的log entry写回映射文件并释放
+ * @return 因被占用而未能处理的已提交entry个数
+ */
+static unsigned long sync_table(log_table_t *table, unsigned long table_addr,
+                                unsigned long current_epoch, uma_t *uma) {
+  return checkpoint_table(table, table_addr, 0, PTRS_PER_TABLE - 1,
+                          current_epoch, uma, false);
+}
+
+/**
+ * @brief 检查点时按写入大小的直方图调整table的log_size
+ * 只在能立即取得uma写锁且table中的log全部写回后才调整，否则等下一个检查点
+ */
+static void resize_table(uma_t *uma, log_table_t *table,
+                         unsigned long table_addr) {
+  log_size_t log_size;
+  int s;
+
+  log_size = preferred_log_size(table);
+  if (log_size == table->log_size) return;
+
+  /* 写锁排除了正在写入的线程，拿不到时不等待 */
+  if (pthread_rwlock_trywrlock(uma->rwlockp) != 0) return;
+
+  if (table->count > 0) {
+    sync_table(table, table_addr, uma->epoch, uma);
+  }
+
+  if (table->count == 0) {
+    __atomic_store_n(&table->log_size, log_size, __ATOMIC_RELEASE);
+  }
+
+  s = pthread_rwlock_unlock(uma->rwlockp);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_rwlock_unlock");
+  }
+}
+
+/**
+ * @brief 检查点时按读写比例切换table的log策略
+ * 两种策略的entry不能共存于一个table，与resize_table一样只在能立即取得
+ * uma写锁且table中的log全部写回后才切换，否则等下一个检查点
+ */
+static void switch_table_policy(uma_t *uma, log_table_t *table,
+                                unsigned long table_addr) {
+  log_policy_t policy;
+  int s;
+
+  policy = preferred_table_policy(table);
+  if (policy == table->policy) return;
+
+  if (pthread_rwlock_trywrlock(uma->rwlockp) != 0) return;
+
+  if (table->count > 0) {
+    sync_table(table, table_addr, uma->epoch, uma);
+  }
+
+  if (table->count == 0) {
+    __atomic_store_n(&table->policy, policy, __ATOMIC_RELEASE);
+    LIBNVMMIO_DEBUG("table %lx: %s", table_addr,
+                    policy == UNDO ? "REDO->UNDO" : "UNDO->REDO");
+  }
+
+  s = pthread_rwlock_unlock(uma->rwlockp);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_rwlock_unlock");
+  }
+}
+
+/**
+ * @brief 由后台同步线程调用，进行sync
+ * 只遍历dirty table位图中被置位的table，开销与含有log的table数成正比
+ *
+ * @return 因被占用而未能写回的已提交entry个数
+ */
+unsigned long sync_uma(uma_t *uma) {
+  unsigned long address, base, current_epoch, bits, word;
+  unsigned long busy = 0;
+  log_table_t *table;
   int s;
 
   /* Acquire the reader lock of the per-file metadata */
@@ -158,57 +437,64 @@ static void sync_uma(uma_t *uma) {
   }
 
   /* get the necessary information from the per-file metadata */
-  address = (unsigned long)(uma->start);
-  end = (unsigned long)(uma->end);
+  base = (unsigned long)ALIGN_TABLE(uma->start);
   current_epoch = uma->epoch;
 
+  /* lease释放后再写回，期间的log由释放lease的线程重新交给同步线程 */
+  if (is_uma_leased(uma)) {
+    s = pthread_rwlock_unlock(uma->rwlockp);
+    if (__glibc_unlikely(s != 0)) {
+      handle_error("pthread_rwlock_unlock");
+    }
+    return 0;
+  }
+
   /* Release the reader lock of the per-file metadata */
   s = pthread_rwlock_unlock(uma->rwlockp);
   if (__glibc_unlikely(s != 0)) {
     handle_error("pthread_rwlock_unlock");
   }
 
-  while (address < end) {
-    table = find_log_table(address);
-
-    if (table && table->count > 0) {
-      log_size = table->log_size;
-      nrlogs = NUM_ENTRIES(log_size);
+  for (word = 0; word < DIRTY_WORDS(uma->nr_tables); word++) {
+    bits = fetch_uma_dirty_tables(uma, word);
 
-      for (i = nrlogs - 1; i > 0; i--) {
-        entry = table->entries[i];
+    while (bits) {
+      address = base + ((word * BITS_PER_LONG + __builtin_ctzl(bits)) << TABLE_SHIFT);
+      bits &= bits - 1;
 
-        if (entry && entry->epoch < current_epoch) {
-          /* Acquire the writer lock of the log entry */
-          if (pthread_rwlock_trywrlock(entry->rwlockp) != 0) continue;
+      table = find_log_table(address);
+      if (table == NULL) continue;
 
-          /* Committed log entry */
-          if (entry->epoch < current_epoch) {
-            if (entry->policy == REDO) {
-              dst = entry->dst + entry->offset;
-              src = entry->data + entry->offset;
-
-              nvmmio_write(dst, src, entry->len, true);
-            }
-            table->entries[i] = NULL;
+      if (table->count > 0) {
+        busy += sync_table(table, address, current_epoch, uma);
+      }
+      resize_table(uma, table, address);
+      switch_table_policy(uma, table, address);
 
-            free_log_entry(entry, log_size, false);
-            atomic_decrease(&table->count);
-            continue;
-          }
-          /* Release the writer lock of the log entry */
-          s = pthread_rwlock_unlock(entry->rwlockp);
-          if (__glibc_unlikely(s != 0)) {
-            handle_error("pthread_rwlock_unlock");
-          }
-        }
+      /* 仍有未提交或被占用的entry，重新标记 */
+      if (table->count > 0) {
+        mark_uma_table_dirty(uma, address);
       }
     }
-    address += table_size;
   }
+
+  /* record的失效在本线程中flush，uma被复用前必须持久化 */
+  nvmmio_fence();
+  release_retired_log_data(uma);
+
+  if (busy == 0) {
+    uma->synced_epoch = current_epoch;
+  }
+
+  /* 将本线程缓存的空闲entry和data块归还给global list */
+  release_local_list();
+  release_local_data_list();
+
+  return busy;
 }
 
 static void cleanup_handler(void) {
+  exit_sync_threads();
   exit_background_table_alloc_thread();
 	cleanup_logs();
 
@@ -227,10 +513,14 @@ void init_libnvmmio(void) {
 		LIBNVMMIO_INIT_TIMER();
 
     init_env();
+    init_policy();
+    recover_logs();
     init_global_freelist();
     init_radixlog();
     init_uma();
     init_base_address();
+    init_uma_directory(base_mmap_addr);
+    init_sync_threads();
 
     atexit(cleanup_handler);
   }
@@ -262,42 +552,6 @@ static inline bool filter_addr(const void *address) {
   return (min_addr <= address) && (address < max_addr);
 }
 
-/**
- * @brief 关闭后台同步线程
- */
-void close_sync_thread(uma_t *uma) {
-  int s;
-  s = pthread_cancel(uma->sync_thread);
-  if (__glibc_unlikely(s != 0)) {
-    handle_error("pthread_cancel");
-  }
-}
-
-/**
- * @brief 后台同步线程执行函数
- */
-static void *sync_thread_func(void *parm) {
-  uma_t *uma;
-  uma = (uma_t *)parm;
-
-  LIBNVMMIO_DEBUG("%d uma thread start on %d", uma->id, sched_getcpu());
-
-  while (true) {
-    usleep(SYNC_PERIOD);
-    sync_uma(uma);
-  }
-  return NULL;
-}
-
-static void create_sync_thread(uma_t *uma) {
-  int s;
-
-  s = pthread_create(&uma->sync_thread, NULL, sync_thread_func, uma);
-  if (__glibc_unlikely(s != 0)) {
-    handle_error("pthread_create");
-  }
-}
-
 /**
  * @brief 建立文件映射，并且记录uma
  * 
@@ -340,16 +594,20 @@ void *nvmmap(void *addr, size_t len, int prot, int flags, int fd,
   uma->ino = (unsigned long)sb.st_ino;
   uma->offset = offset;
   uma->epoch = 1; // 每个file都对应着一个全局的epoch
-  uma->policy = DEFAULT_POLICY;
-
-  if (uma->policy == UNDO) {
-    LIBNVMMIO_DEBUG("policy = UNDO");
-	}
-  else {
-    LIBNVMMIO_DEBUG("policy = REDO");
-	}
-
-  create_sync_thread(uma);
+  uma->sync_state = SYNC_IDLE;
+  uma->sync_node = 0;
+  uma->nr_leases = 0;
+  uma->retired = NULL;
+  init_uma_dirty_tables(uma);
+  uma->applied = map_uma_applied(uma);
+  uma->synced_epoch = 0;
+  INIT_LIST_HEAD(&uma->waiters);
+  set_uma_path(uma, fd);
+  uma->file_size[0] = UMA_FILE_SIZE_UNKNOWN;
+  uma->file_size[1] = UMA_FILE_SIZE_UNKNOWN;
+  uma->pending_file_size = UMA_FILE_SIZE_UNKNOWN;
+  /* 恢复时依赖这些字段找到映射文件，必须在写入log之前持久化 */
+  nvmmio_flush(uma, sizeof(uma_t), true);
 
   if (uma->start < min_addr) {
     min_addr = uma->start;
@@ -360,6 +618,7 @@ void *nvmmap(void *addr, size_t len, int prot, int flags, int fd,
   }
 
   insert_uma_rbtree(uma);
+  insert_uma_directory(uma);
   //insert_uma_syncthreads(uma);
 
   return mmap_addr;
@@ -377,6 +636,12 @@ int nvmunmap_uma(void *addr, size_t n, uma_t *uma) {
     handle_error("the uma must be splitted");
   }
 
+  cancel_sync_uma(uma);
+  release_retired_log_data(uma);
+  free_uma_dirty_tables(uma);
+  /* uma会被复用，不能让恢复时用旧的长度截断文件 */
+  set_uma_file_size(uma, UMA_FILE_SIZE_UNKNOWN);
+  delete_uma_directory(uma);
   delete_uma_rbtree(uma);
   //delete_uma_syncthreads(uma);
   return munmap(addr, n);
@@ -400,14 +665,13 @@ static void sync_entry(log_entry_t *entry, uma_t *uma) {
 
   if (entry->policy == REDO) {
     dst = entry->dst + entry->offset; /* CONFUSE： 这两个为啥能得到dst，复制在 */
-    src = entry->data + entry->offset;
+    src = log_entry_start(entry);
     nvmmio_write(dst, src, entry->len, true);
   }
   entry->epoch = uma->epoch;
-  entry->policy = uma->policy;
   entry->len = 0;
   entry->offset = 0;
-  nvmmio_flush(entry, sizeof(log_entry_t), true);/* 持久化到PM */
+  nvmmio_flush(store_log_record(entry), sizeof(log_record_t), true);/* 持久化到PM */
 }
 
 //                (1)                  (2)                  (3)
@@ -462,8 +726,121 @@ static inline int check_overwrite(void *req_start, void *req_end,
   }
 }
 
+/**
+ * @brief UNDO时把[log_start, log_start + len)对应的原数据从映射文件写入log
+ * 本epoch已在log中的部分保存的才是原数据，映射文件中已是本epoch写入的新数据，
+ * 只补充log中还没有的部分
+ */
+static inline void write_undo_log(log_entry_t *entry, void *log_base,
+                                  void *log_start, unsigned long req_addr,
+                                  size_t len) {
+  void *log_end, *prev_log_start, *prev_log_end, *end, *start;
+
+  if (entry->len == 0) {
+    nvmmio_write(log_start, (void *)req_addr, len, false);
+    return;
+  }
+
+  log_end = log_start + len;
+  prev_log_start = log_base + entry->offset;
+  prev_log_end = prev_log_start + entry->len;
+
+  if (log_start < prev_log_start) {
+    end = log_end < prev_log_start ? log_end : prev_log_start;
+    nvmmio_write(log_start, (void *)req_addr, end - log_start, false);
+  }
+  if (log_end > prev_log_end) {
+    start = log_start > prev_log_end ? log_start : prev_log_end;
+    nvmmio_write(start, (void *)req_addr + (start - log_start), log_end - start,
+                 false);
+  }
+}
+
+/**
+ * @brief 读取一个table内[req_addr, req_addr + len)的数据
+ * 按有效位图只访问有entry的index，其余部分合并为映射文件中的连续段，
+ * 每个字节只从映射文件或log中拷贝一次
+ *
+ * @return 读取期间table的log_size被调整时返回false，需要重读
+ */
+static bool read_redo_table(log_table_t *table, void *dest,
+                            unsigned long req_addr, unsigned long len) {
+  log_entry_t *entry;
+  log_record_t header;
+  unsigned long req_end, page_addr, log_addr, log_end, run_addr;
+  unsigned long index, end, version;
+  log_size_t log_size;
+  void *data;
+
+  log_size = table->log_size;
+  req_end = req_addr + len;
+  run_addr = req_addr; /* 尚未拷贝的映射文件段从这里开始 */
+  index = table_index(log_size, req_addr);
+  end = table_index(log_size, req_end - 1) + 1;
+
+  while ((index = next_table_entry_valid(table, index, end)) < end) {
+    page_addr = (req_addr & TABLE_MASK) + (index << LOG_SHIFT(log_size));
+
+  read_redo_get_entry:
+    entry = table->entries[index];
+
+    if (entry == NULL) {
+      index++;
+      continue;
+    }
+    version = read_begin_log_entry(entry);
+
+    /* entry可能已被写回并释放 */
+    if (__glibc_unlikely(table->entries[index] != entry)) {
+      goto read_redo_get_entry;
+    }
+
+    /* header和data必须来自同一版本，否则算出的地址可能越界 */
+    header.united = entry->united;
+    header.location = entry->location;
+    data = entry->data;
+
+    if (read_retry_log_entry(entry, version)) {
+      goto read_redo_get_entry;
+    }
+
+    data = log_data_base(data, header.log_size, header.offset);
+    log_addr = page_addr + header.offset;
+    log_end = log_addr + header.len;
+
+    /* 只拷贝log与请求范围的交集 */
+    if (log_addr < req_addr) log_addr = req_addr;
+    if (log_end > req_end) log_end = req_end;
+
+    if (log_addr < log_end) {
+      nvmmio_memcpy(dest + (log_addr - req_addr), data + (log_addr - page_addr),
+                    log_end - log_addr);
+
+      /* 读取期间entry被修改或释放 */
+      if (read_retry_log_entry(entry, version)) {
+        goto read_redo_get_entry;
+      }
+
+      if (log_addr > run_addr) {
+        nvmmio_memcpy(dest + (run_addr - req_addr), (void *)run_addr,
+                      log_addr - run_addr);
+      }
+      run_addr = log_end;
+    }
+    index++;
+  }
+
+  if (run_addr < req_end) {
+    nvmmio_memcpy(dest + (run_addr - req_addr), (void *)run_addr,
+                  req_end - run_addr);
+  }
+
+  return __atomic_load_n(&table->log_size, __ATOMIC_ACQUIRE) == log_size;
+}
+
 /**
  * @brief 从redo log读取数据
+ * 只有REDO table需要检查log，UNDO table和没有log的table直接从映射文件拷贝
  * 
  * @param dest 数据待写入的缓冲区
  * @param src 待读取数据的映射地址
@@ -471,121 +848,417 @@ static inline int check_overwrite(void *req_start, void *req_end,
  */
 void nvmemcpy_read_redo(void *dest, const void *src, size_t record_size) {
   log_table_t *table;
-  log_entry_t *entry;
-  void *req_start, *req_end, *log_start, *log_end, *overwrite_dest;
-  unsigned long req_addr, req_offset, req_len, overwrite_len;
-  unsigned long next_page_addr, next_len, next_table_addr, next_table_len;
-  unsigned long index;
-  int s, n;
-  log_size_t log_size;
+  unsigned long req_addr, next_table_addr, next_table_len, start = 0;
+  bool sample;
+  int n;
 
   LIBNVMMIO_INIT_TIME(nvmemcpy_read_redo_time);
   LIBNVMMIO_START_TIME(nvmemcpy_read_redo_t, nvmemcpy_read_redo_time);
 
-  nvmmio_memcpy(dest, src, record_size);
-
+  /* 按table分段读取 */
   n = (unsigned long)record_size;
   req_addr = (unsigned long)src;
 
   while (n > 0) {
     table = find_log_table(req_addr);
 
-    if (table != NULL && table->count > 0) {
-      log_size = table->log_size;
-      index = table_index(log_size, req_addr);
+    next_table_addr = (req_addr + TABLE_SIZE) & TABLE_MASK;
+    next_table_len = next_table_addr - req_addr;
 
-      next_page_addr = (req_addr + LOG_SIZE(log_size)) & LOG_MASK(log_size);// CONFUSE：为什么是按log_size对齐
-      // SOLVE:因为写的时候是这样写入的
-      next_len = next_page_addr - req_addr;
+    if ((int)next_table_len > n)
+      next_table_len = n;
 
-    nvmemcpy_read_get_entry:
-      entry = table->entries[index];
+    /* 抽样测量检查log比直接读取多花的时间，作为代价模型的输入 */
+    sample = sample_read_time();
+    if (sample) {
+      start = policy_clock_ns();
+    }
 
+    if (table_has_redo_log(table)) {
       LIBNVMMIO_INIT_TIME(check_log_time);
       LIBNVMMIO_START_TIME(check_log_t, check_log_time);
 
-      if (entry != NULL) {
-        if (pthread_rwlock_tryrdlock(entry->rwlockp) != 0)
-          goto nvmemcpy_read_get_entry;
-
-        if ((int)next_len >= n)
-          req_len = n;
-        else
-          req_len = next_len;
-
-        log_start = entry->data + entry->offset;
-        log_end = log_start + entry->len;
-
-        req_offset = req_addr & (LOG_SIZE(log_size) - 1);
-        req_start = entry->data + req_offset;
-        req_end = req_start + req_len;
-
-        s = check_overwrite(req_start, req_end, log_start, log_end);
-        // 获取redo log中记录的log起始地址并不包含需要读取的全部数据
-        // 所以可能出现读取部分的情况，甚至无法完全读取
-        switch (s) {
-          case 1:
-            break;
-          case 2:
-            overwrite_dest = dest + (log_start - req_start);
-            overwrite_len = req_end - log_start;
-            nvmmio_memcpy(overwrite_dest, log_start, overwrite_len);// 只读取了部分
-            break;
-          case 3:
-            overwrite_dest = dest + (log_start - req_start);
-            nvmmio_memcpy(overwrite_dest, log_start, entry->len);
-            break;
-          case 4:
-            nvmmio_memcpy(dest, req_start, req_len);
-            break;
-          case 5:
-            overwrite_len = log_end - req_start;
-            nvmmio_memcpy(dest, req_start, overwrite_len);
-            break;
-          case 6:
-            break;
-          default:
-            handle_error("check overwrite");
-        }
-        s = pthread_rwlock_unlock(entry->rwlockp);
-        if (__glibc_unlikely(s != 0)) {
-          handle_error("pthread_rwlock_unlock");
-        }
+      /* table在读取期间被调整了log_size，按新的log_size重读该段 */
+      if (!read_redo_table(table, dest, req_addr, next_table_len)) {
+        continue;
       }
-      req_addr = next_page_addr;
-      dest += next_len;
-      n -= next_len;
-
       LIBNVMMIO_END_TIME(check_log_t, check_log_time);
+
+      if (sample) {
+        account_table_log_read(
+            table, account_log_read_time(next_table_len,
+                                         policy_clock_ns() - start) *
+                       POLICY_SAMPLE_READS);
+      }
     }
     /* No Table */
-    // 即当前addr没有进行写入操作，所以也就没有对应的table。
+    // 即当前addr没有进行写入操作，所以也就没有对应的table；或者table使用UNDO。
     else {
-      next_table_addr = (req_addr + TABLE_SIZE) & TABLE_MASK;
-      next_table_len = next_table_addr - req_addr;
+      nvmmio_memcpy(dest, (void *)req_addr, next_table_len);
+
+      if (sample) {
+        account_direct_read_time(next_table_len, policy_clock_ns() - start);
+      }
+    }
+
+    /* 重读的部分只统计一次 */
+    if (table != NULL) {
+      account_table_read(table, next_table_len);
+    }
+    req_addr = next_table_addr;
+    dest += next_table_len;
+    n -= next_table_len;
+  }
+  LIBNVMMIO_END_TIME(nvmemcpy_read_redo_t, nvmemcpy_read_redo_time);
+}
+
+/**
+ * @brief 向span数组追加[ptr, ptr + len)，与上一个span相邻时合并
+ * @return span数组已满时返回false
+ */
+static inline bool add_read_span(struct iovec *spans, int *nr, int max,
+                                 void *ptr, size_t len) {
+  if (*nr > 0 && spans[*nr - 1].iov_base + spans[*nr - 1].iov_len == ptr) {
+    spans[*nr - 1].iov_len += len;
+    return true;
+  }
+  if (*nr == max) {
+    return false;
+  }
+  spans[*nr].iov_base = ptr;
+  spans[*nr].iov_len = len;
+  *nr += 1;
+  return true;
+}
+
+/**
+ * @brief 零拷贝读取，不拷贝数据而是返回指向映射文件或log数据的span
+ * 调用者需持有uma的lease。UNDO table中映射文件就是最新数据；REDO table中
+ * 有log的部分指向log数据，其余部分指向映射文件
+ *
+ * @param nr_spans 传入spans的个数，返回使用的个数
+ * @return span覆盖的字节数，span不够时小于record_size
+ */
+size_t nvmemcpy_read_zc(const void *src, size_t record_size,
+                        struct iovec *spans, int *nr_spans, uma_t *uma) {
+  log_table_t *table;
+  log_entry_t *entry;
+  log_record_t header;
+  unsigned long req_addr, req_end, next_table_addr, page_addr;
+  unsigned long log_addr, log_end, run_addr;
+  unsigned long index, end, version;
+  log_size_t log_size;
+  void *data;
+  int s, nr = 0, max = *nr_spans;
+
+  /* 排除检查点调整log_size和切换log策略 */
+  s = pthread_rwlock_rdlock(uma->rwlockp);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_rwlock_rdlock");
+  }
+
+  req_addr = (unsigned long)src;
+  req_end = req_addr + record_size;
+  run_addr = req_addr; /* 之前的部分都已放入span */
+
+  while (req_addr < req_end) {
+    table = find_log_table(req_addr);
+
+    next_table_addr = (req_addr + TABLE_SIZE) & TABLE_MASK;
+    if (next_table_addr > req_end)
+      next_table_addr = req_end;
+
+    if (table != NULL) {
+      account_table_read(table, next_table_addr - req_addr);
+    }
+
+    if (table_has_redo_log(table)) {
+      log_size = table->log_size;
+      index = table_index(log_size, req_addr);
+      end = table_index(log_size, next_table_addr - 1) + 1;
+
+      while ((index = next_table_entry_valid(table, index, end)) < end) {
+        page_addr = (req_addr & TABLE_MASK) + (index << LOG_SHIFT(log_size));
+
+      nvmemcpy_read_zc_get_entry:
+        entry = table->entries[index];
+
+        if (entry == NULL) {
+          index++;
+          continue;
+        }
+        version = read_begin_log_entry(entry);
+
+        if (__glibc_unlikely(table->entries[index] != entry)) {
+          goto nvmemcpy_read_zc_get_entry;
+        }
+
+        header.united = entry->united;
+        header.location = entry->location;
+        data = entry->data;
+
+        if (read_retry_log_entry(entry, version)) {
+          goto nvmemcpy_read_zc_get_entry;
+        }
+
+        data = log_data_base(data, header.log_size, header.offset);
+        log_addr = page_addr + header.offset;
+        log_end = log_addr + header.len;
+
+        if (log_addr < run_addr) log_addr = run_addr;
+        if (log_end > next_table_addr) log_end = next_table_addr;
+
+        if (log_addr < log_end) {
+          if (log_addr > run_addr) {
+            if (!add_read_span(spans, &nr, max, (void *)run_addr,
+                               log_addr - run_addr)) {
+              goto nvmemcpy_read_zc_out;
+            }
+            run_addr = log_addr;
+          }
+          if (!add_read_span(spans, &nr, max, data + (log_addr - page_addr),
+                             log_end - log_addr)) {
+            goto nvmemcpy_read_zc_out;
+          }
+          run_addr = log_end;
+        }
+        index++;
+      }
+    }
+
+    if (next_table_addr > run_addr) {
+      if (!add_read_span(spans, &nr, max, (void *)run_addr,
+                         next_table_addr - run_addr)) {
+        goto nvmemcpy_read_zc_out;
+      }
+      run_addr = next_table_addr;
+    }
+    req_addr = next_table_addr;
+  }
+
+nvmemcpy_read_zc_out:
+  s = pthread_rwlock_unlock(uma->rwlockp);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_rwlock_unlock");
+  }
+
+  *nr_spans = nr;
+  return run_addr - (unsigned long)src;
+}
+
+/**
+ * @brief 根据写入数据的size来对log size进行赋值，最小的大于log_size的2的指数倍
+ * 
+ * @param record_size 
+ * @return log_size_t 
+ */
+static inline log_size_t set_log_size(size_t record_size) {
+  log_size_t log_size = LOG_4K;
+  record_size = (record_size - 1) >> PAGE_SHIFT;
+  while (record_size && log_size < LOG_2M) {
+    record_size = record_size >> 1;
+    log_size++;
+  }
+  return log_size;
+}
+
+/**
+ * @brief 返回从addr开始的n字节写入落在当前table内的长度
+ */
+static inline size_t table_write_len(unsigned long addr, int n) {
+  size_t len = TABLE_SIZE - (addr & (TABLE_SIZE - 1));
+  return (size_t)n < len ? (size_t)n : len;
+}
+
+/**
+ * @brief 记录本次写入落在table中的大小和字节数
+ */
+static inline void account_write(log_table_t *table, unsigned long addr,
+                                 int n) {
+  size_t len = table_write_len(addr, n);
+
+  account_table_write(table, set_log_size(len), len);
+}
+
+/**
+ * @brief 跨多个entry的写入一次预留它在当前table内需要的全部entry
+ * 各table的log_size可能不同，每进入一个table按它的log_size重新计算
+ */
+static inline void reserve_table_entries(log_size_t log_size,
+                                         unsigned long addr, int n) {
+  size_t len = table_write_len(addr, n);
+  unsigned long nr_entries;
+
+  nr_entries = ((addr + len - 1) >> LOG_SHIFT(log_size)) -
+               (addr >> LOG_SHIFT(log_size)) + 1;
+  if (nr_entries > 1) {
+    reserve_log_entries(log_size, nr_entries);
+  }
+}
+
+/**
+ * @brief 返回能容纳页内[offset, offset + len)的最小data块大小
+ */
+static inline log_size_t set_subpage_log_size(unsigned long offset,
+                                              unsigned long len) {
+  int log_size;
+
+  for (log_size = LOG_64B; log_size < NR_LOG_SIZES; log_size++) {
+    if ((offset >> DATA_SHIFT(log_size)) ==
+        ((offset + len - 1) >> DATA_SHIFT(log_size))) {
+      return (log_size_t)log_size;
+    }
+  }
+  return LOG_4K;
+}
+
+/**
+ * @brief 保证LOG_4K entry的data块能同时容纳页内[offset, offset + len)和已有的数据
+ *
+ * 放不下时换成更大的data块并拷贝已有的数据，新块持久化后再让record指向它；
+ * entry为空时按本次写入重新选择块大小。调用者必须持有entry的锁。
+ */
+static void fit_log_data(log_entry_t *entry, unsigned long offset,
+                         unsigned long len, uma_t *uma) {
+  unsigned long start = offset, end = offset + len;
+  log_size_t log_size, old_log_size;
+  void *old_data, *old_start;
+
+  if (entry->len > 0) {
+    if (entry->offset < start) {
+      start = entry->offset;
+    }
+    if ((unsigned long)entry->offset + entry->len > end) {
+      end = entry->offset + entry->len;
+    }
+  }
+
+  log_size = set_subpage_log_size(start, end - start);
+  if (log_size == (log_size_t)entry->log_size ||
+      (entry->len > 0 &&
+       DATA_SHIFT(log_size) < DATA_SHIFT((log_size_t)entry->log_size))) {
+    return;
+  }
+
+  old_log_size = entry->log_size;
+  old_start = log_entry_start(entry);
+  old_data = replace_log_data(entry, log_size);
+
+  if (entry->len > 0) {
+    nvmmio_write(log_entry_start(entry), old_start, entry->len, true);
+    nvmmio_flush(store_log_record(entry), sizeof(log_record_t), true);
+  }
+  /* entry已加锁，之后开始的lease只能读到新的data块 */
+  if (__glibc_unlikely(is_uma_leased(uma))) {
+    retire_log_data(uma, old_data, old_log_size);
+  } else {
+    free_log_data(old_data, old_log_size);
+  }
+}
+
+/**
+ * @brief 直接设置并持久化文件长度，用于映射、截断和放弃事务，不等待提交
+ */
+void set_uma_file_size(uma_t *uma, unsigned long size) {
+  __atomic_store_n(&uma->pending_file_size, size, __ATOMIC_RELEASE);
+  uma->file_size[0] = size;
+  uma->file_size[1] = size;
+  nvmmio_flush(uma->file_size, sizeof(uma->file_size), true);
+}
+
+/**
+ * @brief 返回包括未提交写入在内的文件长度
+ */
+unsigned long get_uma_file_size(uma_t *uma) {
+  return __atomic_load_n(&uma->pending_file_size, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief 文件长度只增不减，并发写入时取最大值
+ * 只记录在pending_file_size中，下一次提交时才持久化
+ */
+void extend_uma_file_size(uma_t *uma, unsigned long size) {
+  unsigned long old;
+
+  old = uma->pending_file_size;
+  while (old < size) {
+    if (__sync_bool_compare_and_swap(&uma->pending_file_size, old, size)) {
+      break;
+    }
+    old = uma->pending_file_size;
+  }
+}
+
+/**
+ * @brief 把文件长度写入new_epoch对应的位置，先于epoch持久化
+ * 崩溃时epoch没有持久化则恢复仍使用旧epoch对应的长度。调用者持有uma的写锁
+ */
+static void commit_uma_file_size(uma_t *uma, unsigned long new_epoch,
+                                 bool fence) {
+  unsigned long size = get_uma_file_size(uma);
+  unsigned long *slot = &uma->file_size[new_epoch & 1];
+
+  if (*slot != size) {
+    *slot = size;
+    nvmmio_flush(slot, sizeof(unsigned long), fence);
+  }
+}
+
+/**
+ * @brief 追加写入文件末尾之后的区域
+ *
+ * 这部分区域没有旧数据需要保护，不经过log，直接用NT store写入映射文件。
+ * 新的文件长度在下一次提交时随epoch一起持久化，提交之前崩溃时追加的数据被截掉
+ */
+void nvmemcpy_append(void *dst, const void *src, size_t n) {
+  nvmmio_write(dst, src, n, true);
+}
+
+/**
+ * @brief 写入跨越不同策略的table时，只就地更新其中UNDO table的部分
+ * 调用者持有uma的读锁，table的策略不会改变
+ */
+static void write_undo_tables(void *dst, const void *src, size_t record_size) {
+  log_table_t *table;
+  unsigned long req_addr, next_table_addr, next_table_len;
+  size_t n = record_size;
+
+  req_addr = (unsigned long)dst;
+
+  while (n > 0) {
+    table = find_log_table(req_addr);
 
-      req_addr = next_table_addr;
-      dest += next_table_len;
-      n -= next_table_len;
+    next_table_addr = (req_addr + TABLE_SIZE) & TABLE_MASK;
+    next_table_len = next_table_addr - req_addr;
+    if (next_table_len > n)
+      next_table_len = n;
+
+    if (table != NULL && table->policy == UNDO) {
+      nvmmio_write((void *)req_addr, src, next_table_len, false);
     }
+    req_addr = next_table_addr;
+    src += next_table_len;
+    n -= next_table_len;
   }
-  LIBNVMMIO_END_TIME(nvmemcpy_read_redo_t, nvmemcpy_read_redo_time);
+  nvmmio_fence();
 }
 
 /**
- * @brief 根据写入数据的size来对log size进行赋值，最小的大于log_size的2的指数倍
- * 
- * @param record_size 
- * @return log_size_t 
+ * @brief [addr, addr + n)中是否有REDO table的log，没有时可以直接访问映射文件
  */
-static inline log_size_t set_log_size(size_t record_size) {
-  log_size_t log_size = LOG_4K;
-  record_size = (record_size - 1) >> PAGE_SHIFT;
-  while (record_size) {
-    record_size = record_size >> 1;
-    log_size++;
+static bool has_redo_log(const void *addr, size_t n) {
+  unsigned long req_addr, end;
+
+  req_addr = (unsigned long)addr;
+  end = req_addr + n;
+
+  while (req_addr < end) {
+    if (table_has_redo_log(find_log_table(req_addr))) {
+      return true;
+    }
+    req_addr = (req_addr + TABLE_SIZE) & TABLE_MASK;
   }
-  return log_size;
+  return false;
 }
 
 /**
@@ -603,16 +1276,21 @@ void nvmemcpy_write(void *dst, const void *src, size_t record_size,
   unsigned long req_addr, next_page_addr, req_offset;
   const void *source;
   void *destination, *overwrite_src;
-  void *log_start, *log_end;
+  void *log_start, *log_end, *log_base;
   void *prev_log_start, *prev_log_end;
   size_t next_len, req_len, overwrite_len;
   unsigned long index;
-  log_size_t log_size;
-  int s, n;
+  log_size_t log_size, data_size;
+  log_policy_t policy;
+  unsigned int backoff = 0;
+  int s, n, nr_tables = 1, nr_undo = 0;
 
   LIBNVMMIO_INIT_TIME(nvmemcpy_write_time);
   LIBNVMMIO_START_TIME(nvmemcpy_write_t, nvmemcpy_write_time);
 
+  /* log空间不足时先等待同步线程回收 */
+  throttle_log_writer(set_log_size(record_size));
+
   s = pthread_rwlock_rdlock(uma->rwlockp);
   if (__glibc_unlikely(s != 0)) {
     handle_error("pthread_rwlock_rdlock");
@@ -626,15 +1304,12 @@ void nvmemcpy_write(void *dst, const void *src, size_t record_size,
   n = (int)record_size;
   req_addr = (unsigned long)dst;
 
-  table = get_log_table(req_addr);/* 获取Index Entry对应的Table */
-
-  /* TODO: log_size must be updated atomically */
-  if (table->count == 0) {
-    log_size = set_log_size(record_size);
-    table->log_size = log_size;
-  } else {
-    log_size = table->log_size;
-  }
+  /* 新table按本次写入的大小创建，已有table的log_size只在检查点调整 */
+  table = get_log_table(req_addr, set_log_size(record_size));/* 获取Index Entry对应的Table */
+  log_size = table->log_size;
+  policy = table->policy;
+  if (policy == UNDO) nr_undo++;
+  account_write(table, req_addr, n);
 /* 当log_size为LOG_2M时，index为0，
  * 对应论文中的当Log Entry为2MB时，最后21bits都是entry内的偏移
  */
@@ -643,7 +1318,30 @@ void nvmemcpy_write(void *dst, const void *src, size_t record_size,
 
   LIBNVMMIO_END_TIME(indexing_log_t, indexing_log_time);
 
+  reserve_table_entries(log_size, req_addr, n);
+
   while (n > 0 && table != NULL) {
+    req_offset = LOG_OFFSET(req_addr, log_size);
+    /* BUGBEGIN：这一段代码貌似会经常导致大量的数据丢弃
+     * log_size是req_size的最小包容
+     * 而req_offset往往不为0，所以会经常导致数据缺失
+     * */
+    // SOLVE:后面会将多于的写到写一个entry。但是这样会跨entry。一定程度上应该会降低性能
+    next_page_addr = (req_addr + LOG_SIZE(log_size)) & LOG_MASK(log_size);
+    next_len = next_page_addr - req_addr;// 这个值是一定能够被long entry所包容的
+
+    if ((int)next_len > n)
+      req_len = n;
+    else
+      req_len = next_len; 
+
+    /* 页内的小写只占用能容纳它的小data块 */
+    if (log_size == LOG_4K) {
+      data_size = set_subpage_log_size(req_offset, req_len);
+    } else {
+      data_size = log_size;
+    }
+
   nvmemcpy_write_get_entry:
 
     entry = table->entries[index];
@@ -652,45 +1350,47 @@ void nvmemcpy_write(void *dst, const void *src, size_t record_size,
     LIBNVMMIO_START_TIME(alloc_log_t, alloc_log_time);
 
     if (entry == NULL) {
-      entry = alloc_log_entry(uma, log_size);
+      entry = alloc_log_entry(uma, data_size, policy);
       /* CONFUSE：为什么这里不直接判断是否为NULL，在进行alloc。
        * 是否是并发可能会导致错误？ */
       if (__sync_bool_compare_and_swap(&table->entries[index], NULL, entry)) {
         atomic_increase(&table->count);
+        set_table_entry_valid(table, index);
+        mark_uma_table_dirty(uma, req_addr);
       } else {
-        free_log_entry(entry, log_size, false);
+        lock_log_entry(entry);
+        free_log_entry(entry, false);
         entry = table->entries[index];
       }
     }
     LIBNVMMIO_END_TIME(alloc_log_t, alloc_log_time);
 
-    if (pthread_rwlock_trywrlock(entry->rwlockp) != 0)/* 试图上锁， 基于log entry的细粒度的锁 */
+    /* 试图上锁， 基于log entry的细粒度的锁 */
+    if (!try_lock_log_entry(entry)) {
+      log_lock_backoff(&backoff);
       goto nvmemcpy_write_get_entry;
-
-    if (entry->epoch < uma->epoch) { /* 未被提交的log entry */
-      sync_entry(entry, uma); /* checkpoints */
     }
 
-    req_offset = LOG_OFFSET(req_addr, log_size);
-    /* BUGBEGIN：这一段代码貌似会经常导致大量的数据丢弃
-     * log_size是req_size的最小包容
-     * 而req_offset往往不为0，所以会经常导致数据缺失
-     * */
-    // SOLVE:后面会将多于的写到写一个entry。但是这样会跨entry。一定程度上应该会降低性能
-    next_page_addr = (req_addr + LOG_SIZE(log_size)) & LOG_MASK(log_size);
-
-    log_start = entry->data + req_offset;
-    next_len = next_page_addr - req_addr;// 这个值是一定能够被long entry所包容的
+    /* 加锁前entry可能已被同步线程写回并释放 */
+    if (__glibc_unlikely(table->entries[index] != entry)) {
+      unlock_log_entry(entry);
+      goto nvmemcpy_write_get_entry;
+    }
+    backoff = 0;
 
+    if (log_epoch(entry->epoch, uma->epoch) < uma->epoch) { /* 未被提交的log entry */
+      sync_entry(entry, uma); /* checkpoints */
+    }
 
-    if ((int)next_len > n)
-      req_len = n;
-    else
-      req_len = next_len; 
+    if (log_size == LOG_4K) {
+      fit_log_data(entry, req_offset, req_len, uma);
+    }
+    log_base = log_data_base(entry->data, entry->log_size, req_offset);
+    log_start = log_base + req_offset;
 
-    if (uma->policy == UNDO) {
+    if (policy == UNDO) {
       /* 处理UNDO事务，将原数据写入log */
-      nvmmio_write(log_start, dst, req_len, false);
+      write_undo_log(entry, log_base, log_start, req_addr, req_len);
     } else {
       /* 处理REDO事务，直接将数据写入log*/
       nvmmio_write(log_start, src, req_len, false);
@@ -698,13 +1398,21 @@ void nvmemcpy_write(void *dst, const void *src, size_t record_size,
     /*BUGEND*/
     if (entry->len > 0) {  // 说明发生overwrite
       log_end = log_start + req_len;
-      prev_log_start = entry->data + entry->offset;
+      prev_log_start = log_base + entry->offset;
       prev_log_end = prev_log_start + entry->len;
 
+      /* 与本epoch中已在log的数据重叠的部分，REDO时只需写回一次 */
+      if (log_start < prev_log_end && prev_log_start < log_end) {
+        account_table_overwrite(
+            table, (log_end < prev_log_end ? log_end : prev_log_end) -
+                       (log_start > prev_log_start ? log_start
+                                                   : prev_log_start));
+      }
+
       s = check_overwrite(log_start, log_end, prev_log_start, prev_log_end);
       switch (s) {
         case 1:/* log_start <= prev_log_start; log_end < prev_log_start */
-          overwrite_src = dst + req_len;
+          overwrite_src = (void *)req_addr + req_len;
           overwrite_len = prev_log_start - log_end;
           nvmmio_write(log_end, overwrite_src, overwrite_len, false);// 多写一点进来，应该是为了保证entry中数据的连续性并对应offset和len这两个成员
           entry->offset = req_offset;
@@ -725,7 +1433,7 @@ void nvmemcpy_write(void *dst, const void *src, size_t record_size,
           break;
         case 6:/* log_start > prev_log_start; log_end > prev_log_end; prev_log_end < log_start */
           overwrite_len = log_start - prev_log_end;
-          overwrite_src = dst - overwrite_len;
+          overwrite_src = (void *)req_addr - overwrite_len;
           nvmmio_write(prev_log_end, overwrite_src, overwrite_len, false);
           entry->len = log_end - prev_log_start;
           break;
@@ -736,29 +1444,35 @@ void nvmemcpy_write(void *dst, const void *src, size_t record_size,
       /* 对dst和offset赋值供持久化时获取dst。 */
       entry->offset = req_offset;
       entry->len = req_len;
-      entry->dst = (void *)(req_addr & PAGE_MASK);
+      set_log_entry_dst(entry, uma, (void *)(req_addr & LOG_MASK(log_size)));
     }
     /* 持久化Index Entry */
-    nvmmio_flush(entry, sizeof(log_entry_t), false);
+    nvmmio_flush(store_log_record(entry), sizeof(log_record_t), false);
 
-    s = pthread_rwlock_unlock(entry->rwlockp);
-    if (__glibc_unlikely(s != 0)) {
-      handle_error("pthread_rwlock_unlock");
-    }
+    unlock_log_entry(entry);
 
     req_addr = next_page_addr;
     src += next_len;
     n -= (int)next_len;
     index += 1;
-    if (index == PTRS_PER_TABLE && n > 0) {
-      table = get_next_table2(table, TABLE);
+    if (index == NUM_ENTRIES(log_size) && n > 0) {
+      table = get_next_table2(table, TABLE, set_log_size(n));
       index = 0;
+      log_size = table->log_size;
+      policy = table->policy;
+      if (policy == UNDO) nr_undo++;
+      nr_tables++;
+      account_write(table, req_addr, n);
+      reserve_table_entries(log_size, req_addr, n);
     }
   }
   nvmmio_fence();
 
-  if (uma->policy == UNDO) {
+  /* 旧数据都已持久化到log之后，UNDO table的部分才能就地更新 */
+  if (nr_undo == nr_tables) {
     nvmmio_write(destination, source, record_size, true); //就地更新
+  } else if (nr_undo > 0) {
+    write_undo_tables(destination, source, record_size);
   }
 
   s = pthread_rwlock_unlock(uma->rwlockp);
@@ -775,13 +1489,12 @@ void nvmemcpy_write(void *dst, const void *src, size_t record_size,
  * @param src 
  * @param n 
  * @param dst_uma 
- * @param src_uma 
  */
 static inline void nvmemcpy_f2f_write(void *dst, const void *src, size_t n,
-                                      uma_t *dst_uma, uma_t *src_uma) {
+                                      uma_t *dst_uma) {
   void *buf;
 
-  if (src_uma->policy == UNDO) {
+  if (!has_redo_log(src, n)) {
     nvmemcpy_write(dst, src, n, dst_uma);
   } else {
     buf = (void *)malloc(n);
@@ -794,79 +1507,66 @@ static inline void nvmemcpy_f2f_write(void *dst, const void *src, size_t n,
   }
 }
 
-static size_t nvstrlen_redo(char *start, char *end, bool *next) {
-  char *s;
-  unsigned long offset;
+/**
+ * @brief 映射文件中的字符串是否经过含有REDO log的table
+ * 没有REDO log的table中映射文件就是最新数据，在其中找到结束符即可停止
+ */
+static bool string_has_redo_log(const char *src, uma_t *uma) {
+  unsigned long req_addr, next_table_addr, end;
 
-  for (s = start; s < end; ++s) {
-    if (!(*s)) break;
-  }
+  req_addr = (unsigned long)src;
+  end = (unsigned long)uma->end;
+
+  while (req_addr < end) {
+    if (table_has_redo_log(find_log_table(req_addr))) {
+      return true;
+    }
 
-  offset = (unsigned long)s & (~PAGE_MASK);
-  if (offset == 0)
-    *next = true;
-  else
-    *next = false;
+    next_table_addr = (req_addr + TABLE_SIZE) & TABLE_MASK;
+    if (next_table_addr > end)
+      next_table_addr = end;
 
-  return (s - start);
+    if (memchr((void *)req_addr, '\0', next_table_addr - req_addr) != NULL) {
+      return false;
+    }
+    req_addr = next_table_addr;
+  }
+  return false;
 }
 
-// dst is a pointer to user buffer
-// src is a pointer to memory mapped file
-static void get_string_from_redo(char **dst, const char *src) {
-  log_entry_t *entry;
-  unsigned long req_addr, req_offset;
-  void *log_start, *log_end, *req_start;
-  size_t n, len = 0;
-  bool next;
+/**
+ * @brief 按页读出映射文件中的字符串，每个table按自己的策略读取
+ * 返回的缓冲区由调用者释放
+ */
+static char *read_string_from_log(const char *src, uma_t *uma) {
+  unsigned long req_addr, next_page_addr, end;
+  size_t len = 0, n;
+  char *buf = NULL;
 
   req_addr = (unsigned long)src;
+  end = (unsigned long)uma->end;
 
-  do {
-  get_string_from_redo_get_entry:
-    entry = find_log_entry(req_addr);
-
-    if (entry != NULL) {
-      if (pthread_rwlock_tryrdlock(entry->rwlockp) != 0)
-        goto get_string_from_redo_get_entry;
-
-      req_offset = req_addr & (~PAGE_MASK);
-      req_start = entry->data + req_offset;
-      log_start = entry->data + entry->offset;
-      log_end = log_start + entry->len;
-
-      if (log_start <= req_start && req_start < log_end) {
-        n = nvstrlen_redo(req_start, log_end, &next);
-
-        if (len == 0) {
-          if (!next)
-            len = n + 1;
-          else
-            len = n;
-
-          *dst = (char *)malloc(len);
-          if (*dst == NULL) {
-            handle_error("malloc");
-          }
+  while (req_addr < end) {
+    next_page_addr = (req_addr + PAGE_SIZE) & PAGE_MASK;
+    if (next_page_addr > end)
+      next_page_addr = end;
+    n = next_page_addr - req_addr;
 
-          memcpy(*dst, req_start, len);
-        } else {
-          if (!next)
-            len = len + n + 1;
-          else
-            len = n;
-
-          *dst = (char *)realloc(*dst, len);
-          if (*dst == NULL) {
-            handle_error("realloc");
-          }
+    buf = (char *)realloc(buf, len + n + 1);
+    if (__glibc_unlikely(buf == NULL)) {
+      handle_error("realloc");
+    }
 
-          strcat(*dst, req_start);
-        }
-      }
+    nvmemcpy_read_redo(buf + len, (void *)req_addr, n);
+    if (memchr(buf + len, '\0', n) != NULL) {
+      return buf;
     }
-    req_addr = (req_addr + PAGE_SIZE) & PAGE_MASK;
-  } while (next);
+    len += n;
+    req_addr = next_page_addr;
+  }
+
+  buf[len] = '\0';
+  return buf;
 }
 
 /**
@@ -890,9 +1590,7 @@ void *nvmemcpy(void *dst, const void *src, size_t n) {
         src_uma = find_uma(src);
 
         if (src_uma) {
-          increase_uma_read_cnt(src_uma);
-
-          nvmemcpy_f2f_write(dst, src, n, dst_uma, src_uma);
+          nvmemcpy_f2f_write(dst, src, n, dst_uma);
           goto nvmemcpy_out;
         }
       }
@@ -904,15 +1602,8 @@ void *nvmemcpy(void *dst, const void *src, size_t n) {
       src_uma = find_uma(src);
 
       if (src_uma) {
-        increase_uma_read_cnt(src_uma);
-
-        if (src_uma->policy == UNDO) {
-          memcpy(dst, src, n);
-          goto nvmemcpy_out;
-        } else {
-          nvmemcpy_read_redo(dst, src, n);
-          goto nvmemcpy_out;
-        }
+        nvmemcpy_read_redo(dst, src, n);
+        goto nvmemcpy_out;
       }
     }
   }
@@ -922,79 +1613,156 @@ nvmemcpy_out:
   return dst;
 }
 
+/**
+ * @brief 写回table中[start, end)范围内已提交的log entry并释放
+ */
+static void nvmsync_table(log_table_t *table, unsigned long table_addr,
+                          unsigned long start, unsigned long end,
+                          unsigned long new_epoch, uma_t *uma) {
+  log_size_t log_size;
+
+  log_size = table->log_size;
+  if (start < table_addr) start = table_addr;
+  if (end > table_addr + TABLE_SIZE) end = table_addr + TABLE_SIZE;
+
+  checkpoint_table(table, table_addr, table_index(log_size, start),
+                   table_index(log_size, end - 1), new_epoch, uma, true);
+}
+
+/**
+ * @brief 由一个线程写回的一段table
+ */
+typedef struct nvmsync_slice_struct {
+  uma_t *uma;
+  log_table_t **tables;
+  unsigned long *addrs; /* 每个table对应的映射地址 */
+  unsigned long nr_tables;
+  unsigned long start, end;
+  unsigned long new_epoch;
+} nvmsync_slice_t;
+
+static void nvmsync_slice(void *arg) {
+  nvmsync_slice_t *slice = arg;
+  unsigned long i;
+
+  for (i = 0; i < slice->nr_tables; i++) {
+    nvmsync_table(slice->tables[i], slice->addrs[i], slice->start, slice->end,
+                  slice->new_epoch, slice->uma);
+  }
+  /* 各table中record的失效只flush过，返回前统一drain */
+  nvmmio_fence();
+  release_local_list();
+}
+
 /**
  * @brief 同步file,
  * nvmsync_sync <- nvmsync_uma <- nvmsync
+ * 含有log的table较多时按entry个数平均分成多段，交给同步线程池并行写回，
+ * 调用线程也写回其中一段，全部完成后返回
+ *
  * @param addr 内存映射文件地址
  * @param len 内存映射文件大小
  * @param new_epoch 
  */
-static void nvmsync_sync(void *addr, size_t len, unsigned long new_epoch) {
+static void nvmsync_sync(void *addr, size_t len, unsigned long new_epoch,
+                         uma_t *uma) {
+  nvmsync_slice_t slices[MAX_NR_SYNC_THREADS + 1];
+  sync_task_t tasks[MAX_NR_SYNC_THREADS + 1];
+  log_table_t **tables;
   log_table_t *table;
-  log_entry_t *entry;
-  log_size_t log_size;
-  unsigned long address, nrpages, start, end, i;
-  void *dst, *src;
-  int s;
+  unsigned long *addrs;
+  unsigned long start, end, address, nr_tables = 0, max_tables;
+  unsigned long total = 0, per_slice, weight, i;
+  int nr_slices, n;
+
+  start = (unsigned long)addr;
+  end = start + len;
+  if (start >= end) return;
+
+  max_tables = ((end - 1) >> TABLE_SHIFT) - (start >> TABLE_SHIFT) + 1;
+  tables = malloc(max_tables * (sizeof(log_table_t *) + sizeof(unsigned long)));
+  if (__glibc_unlikely(tables == NULL)) {
+    handle_error("malloc");
+  }
+  addrs = (unsigned long *)(tables + max_tables);
 
-  address = (unsigned long)addr;
+  /* 收集含有log的table，每个table的entry个数作为写回的工作量 */
+  for (address = start & TABLE_MASK; address < end; address += TABLE_SIZE) {
+    table = find_log_table(address);
 
-  table = get_log_table(address);
-  log_size = table->log_size;
-  nrpages = len >> LOG_SHIFT(log_size); // 最多跨越的log entries的个数
-  start = table_index(log_size, address);
-
-  if (NUM_ENTRIES(log_size) - start > nrpages)
-    end = start + nrpages;
-  else
-    end = NUM_ENTRIES(log_size);
-
-  while (nrpages > 0 && table != NULL) {
-    if (table->count > 0) {
-      for (i = start; i < end; i++) {
-      retry_sync_nvmsync_get_entry:
-        entry = table->entries[i];
-
-        if (entry != NULL && entry->epoch < new_epoch) {
-          /* lock the entry */
-          if (pthread_rwlock_trywrlock(entry->rwlockp) != 0)
-            goto retry_sync_nvmsync_get_entry;
-
-          /* sync the entry */
-          if (entry->epoch < new_epoch) {
-            if (entry->policy == REDO) {
-              dst = entry->dst + entry->offset;
-              src = entry->data + entry->offset;
-
-              nvmmio_write(dst, src, entry->len, false);
-            }
-            table->entries[i] = NULL;
-            nvmmio_fence(); 
+    if (table != NULL && table->count > 0) {
+      tables[nr_tables] = table;
+      addrs[nr_tables] = address;
+      nr_tables++;
+      total += table->count;
+    }
+  }
 
-            free_log_entry(entry, log_size, false);
-            atomic_decrease(&table->count);
-            continue;
-          }
-          /* unlock the entry */
-          s = pthread_rwlock_unlock(entry->rwlockp);
-          if (__glibc_unlikely(s != 0)) {
-            handle_error("pthread_rwlock_unlock");
-          }
-        }
-      }
+  nr_slices = total / NVMSYNC_SLICE_ENTRIES;
+  if (nr_slices > get_nr_sync_threads() + 1) {
+    nr_slices = get_nr_sync_threads() + 1;
+  }
+  if (nr_slices < 1) {
+    nr_slices = 1;
+  }
+  per_slice = (total + nr_slices - 1) / nr_slices;
+
+  for (n = 0, i = 0; n < nr_slices && i < nr_tables; n++) {
+    tasks[n].func = nvmsync_slice;
+    tasks[n].arg = &slices[n];
+    slices[n].uma = uma;
+    slices[n].tables = &tables[i];
+    slices[n].addrs = &addrs[i];
+    slices[n].start = start;
+    slices[n].end = end;
+    slices[n].new_epoch = new_epoch;
+
+    for (weight = 0; i < nr_tables && weight < per_slice; i++) {
+      weight += tables[i]->count;
     }
-    nrpages -= (end - start);
-    start = 0;
+    slices[n].nr_tables = &tables[i] - slices[n].tables;
+  }
 
-    if (NUM_ENTRIES(log_size) - start > nrpages)
-      end = start + nrpages;
-    else
-      end = NUM_ENTRIES(log_size);
+  if (n == 1) {
+    nvmsync_slice(&slices[0]);
+  } else if (n > 1) {
+    run_sync_tasks(tasks, n);
+  }
+
+  free(tables);
+}
+
+/**
+ * @brief 新的epoch持久化之后的处理：MS_SYNC时写回文件，
+ * 释放uma的写锁，唤醒同步线程
+ */
+static void finish_commit_uma(void *addr, size_t len, int flags, uma_t *uma,
+                              unsigned long new_epoch) {
+  int s;
+  bool sync = false;
+
+  if (uma->write > 0) {
+    sync = true;
+  }
 
-    table = get_next_table(table, &nrpages);
+  /* 只统计两次提交之间的写入，log策略由检查点按table切换 */
+  uma->write = 0;
+
+  if (sync) {
+    if (flags & MS_SYNC) {
+      nvmsync_sync(addr, len, new_epoch, uma);
+    }
   }
 
-  release_local_list();
+  s = pthread_rwlock_unlock(uma->rwlockp);/* 释放对uma上的锁 */
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_rwlock_unlock");
+  }
+
+  /* 新的epoch使之前的log entry全部提交，唤醒同步线程写回 */
+  if (is_uma_dirty(uma)) {
+    enqueue_sync_uma(uma);
+  }
 }
 
 /**
@@ -1009,7 +1777,6 @@ static void nvmsync_sync(void *addr, size_t len, unsigned long new_epoch) {
 int nvmsync_uma(void *addr, size_t len, int flags, uma_t *uma) {
   unsigned long new_epoch;
   int s, ret;
-  bool sync = false;
 
 	LIBNVMMIO_DEBUG("uma id=%d", uma->id);
 
@@ -1029,65 +1796,230 @@ int nvmsync_uma(void *addr, size_t len, int flags, uma_t *uma) {
   }
 
   new_epoch = uma->epoch + 1;
+  commit_uma_file_size(uma, new_epoch, true);
   uma->epoch = new_epoch;
   /* 将uma持久化，且不通过CPU CACHE */
   nvmmio_flush(&(uma->epoch), sizeof(unsigned long), true);
 
-  if (uma->write > 0) {
-    sync = true;
-  }
+  finish_commit_uma(addr, len, flags, uma, new_epoch);
 
-  /* Hybrid Logging */
-#if 1
-  log_policy_t new_policy;
-  unsigned long total, write_ratio;
+  ret = 0;
 
-  total = uma->read + uma->write;
+  LIBNVMMIO_END_TIME(fsync_t, fsync_time);
 
-  if (total > 0) {
-    write_ratio = uma->write / total * 100;
-    /* 修改log policy */
-    if (write_ratio > HYBRID_WRITE_RATIO) {
-      new_policy = REDO;
-    } else {
-      new_policy = UNDO;
+nvmsync_out:
+  return ret;
+}
+
+/**
+ * @brief 丢弃table中未提交的log entry
+ * REDO entry直接丢弃，UNDO entry先把旧数据写回映射文件。
+ * 旧数据先于record的失效持久化，record的失效先于data块的重用持久化
+ */
+static void abort_table(log_table_t *table, unsigned long epoch, uma_t *uma) {
+  log_entry_t *aborted[PTRS_PER_TABLE];
+  unsigned long index[PTRS_PER_TABLE];
+  unsigned long nrlogs, i, nr = 0;
+  log_size_t log_size;
+  log_entry_t *entry;
+  bool undo = false;
+
+  nrlogs = NUM_ENTRIES(table->log_size);
+
+  for (i = next_table_entry_valid(table, 0, nrlogs); i < nrlogs;
+       i = next_table_entry_valid(table, i + 1, nrlogs)) {
+    entry = table->entries[i];
+
+    if (entry == NULL || log_epoch(entry->epoch, epoch) < epoch) continue;
+
+    /* 持有uma的写锁，只有同步线程会短暂占用entry */
+    lock_log_entry(entry);
+
+    if (entry->policy == UNDO && entry->len > 0) {
+      nvmmio_write(entry->dst + entry->offset, log_entry_start(entry),
+                   entry->len, false);
+      undo = true;
     }
+    aborted[nr] = entry;
+    index[nr] = i;
+    nr++;
+  }
+
+  if (nr == 0) return;
+
+  if (undo) {
+    nvmmio_fence();
+  }
 
-    uma->read = 0;
-    uma->write = 0;
+  for (i = 0; i < nr; i++) {
+    table->entries[index[i]] = NULL;
+    clear_table_entry_valid(table, index[i]);
+
+    aborted[i]->record->united = 0;
+    aborted[i]->record->location = 0;
+    nvmmio_flush(aborted[i]->record, sizeof(log_record_t), false);
+  }
+  nvmmio_fence();
 
-    if (uma->policy != new_policy) { // 如果log 策略不变 则直接返回。
-      flags &= ~MS_ASYNC;
-      flags |= MS_SYNC;
-      uma->policy = new_policy;
+  for (i = 0; i < nr; i++) {
+    entry = aborted[i];
 
-      if (new_policy == UNDO) {
-        LIBNVMMIO_DEBUG("REDO->UNDO");
-			}
-      else {
-        LIBNVMMIO_DEBUG("UNDO->REDO");
-			}
+    /* lease读到的data块要等lease释放后才能回收 */
+    if (__glibc_unlikely(is_uma_leased(uma))) {
+      log_size = entry->log_size;
+      retire_log_data(uma, replace_log_data(entry, log_size), log_size);
     }
+    free_log_entry(entry, false);
+    atomic_decrease(&table->count);
   }
-#endif
+}
 
-  if (sync) {
-    if (flags & MS_SYNC) {
-      nvmsync_sync(addr, len, new_epoch);
+/**
+ * @brief 丢弃uma中当前epoch的全部log entry，映射文件回到上一次提交时的内容
+ * nvtx_abort <- nvmabort_uma
+ */
+int nvmabort_uma(uma_t *uma) {
+  unsigned long address, end, epoch;
+  log_table_t *table;
+  int s;
+
+  s = pthread_rwlock_wrlock(uma->rwlockp);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_rwlock_wrlock");
+  }
+
+  epoch = uma->epoch;
+  end = (unsigned long)uma->end;
+
+  /*
+   * 不能只看dirty table位图：同步线程处理时会先清除整个字，处理完才重新标记，
+   * 所以逐个查找映射区域内的table
+   */
+  for (address = (unsigned long)ALIGN_TABLE(uma->start); address < end;
+       address += TABLE_SIZE) {
+    table = find_log_table(address);
+    if (table != NULL && table->count > 0) {
+      abort_table(table, epoch, uma);
     }
   }
+  release_local_list();
+  release_local_data_list();
 
-  s = pthread_rwlock_unlock(uma->rwlockp);/* 释放对uma上的锁 */
+  s = pthread_rwlock_unlock(uma->rwlockp);
   if (__glibc_unlikely(s != 0)) {
     handle_error("pthread_rwlock_unlock");
   }
+  return 0;
+}
 
-  ret = 0;
+static pthread_mutex_t group_commit_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-  LIBNVMMIO_END_TIME(fsync_t, fsync_time);
+static int compare_sync_member(const void *a, const void *b) {
+  const nvmsync_member_t *x = a, *y = b;
 
-nvmsync_out:
-  return ret;
+  return (x->uma > y->uma) - (x->uma < y->uma);
+}
+
+/**
+ * @brief 多个文件的组提交
+ * 所有uma的新epoch先写入一个commit record，drain之后整组提交生效；
+ * 再flush各uma的epoch并drain一次，共两次drain，而不是每个文件各一次。
+ * 恢复时按commit record提高各uma的epoch，各文件要么全部提交要么全部未提交
+ *
+ * @param members 会被按uma排序并去重，按此顺序加锁避免死锁
+ */
+int nvmsync_group(nvmsync_member_t *members, int nr, int flags) {
+  commit_record_t *record = get_commit_record();
+  uma_t *uma;
+  int i, n, s;
+
+  if (nr <= 0) return 0;
+
+  for (i = 0; i < nr; i++) {
+    if (offset_in_page((unsigned long)members[i].addr)) {
+      return -1;
+    }
+    members[i].len = (members[i].len + (~PAGE_MASK)) & PAGE_MASK;
+  }
+
+  qsort(members, nr, sizeof(nvmsync_member_t), compare_sync_member);
+  for (i = 1, n = 1; i < nr; i++) {
+    if (members[i].uma != members[n - 1].uma) {
+      members[n++] = members[i];
+    } else if (members[i].len > members[n - 1].len) {
+      members[n - 1].len = members[i].len;
+    }
+  }
+  nr = n;
+
+  if (nr == 1) {
+    return nvmsync_uma(members[0].addr, members[0].len, flags, members[0].uma);
+  }
+
+  for (i = 0; i < nr; i++) {
+    s = pthread_rwlock_wrlock(members[i].uma->rwlockp);
+    if (__glibc_unlikely(s != 0)) {
+      handle_error("pthread_rwlock_wrlock");
+    }
+  }
+
+  /* commit.log只有一个record，持久化各uma的epoch之前不能被覆盖 */
+  s = pthread_mutex_lock(&group_commit_mutex);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error_en(s, "pthread_mutex_lock");
+  }
+
+  record->seq++;
+  record->nr = nr;
+  for (i = 0; i < nr; i++) {
+    uma = members[i].uma;
+    record->entries[i].uma = get_uma_index(uma);
+    record->entries[i].id = uma->id;
+    record->entries[i].epoch = uma->epoch + 1;
+    /* 与commit record一起drain */
+    commit_uma_file_size(uma, record->entries[i].epoch, false);
+  }
+  record->csum = commit_record_csum(record);
+  nvmmio_flush(record, (char *)&record->entries[nr] - (char *)record, true);
+
+  for (i = 0; i < nr; i++) {
+    uma = members[i].uma;
+    uma->epoch = record->entries[i].epoch;
+    nvmmio_flush(&uma->epoch, sizeof(unsigned long), false);
+  }
+  nvmmio_fence();
+
+  s = pthread_mutex_unlock(&group_commit_mutex);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error_en(s, "pthread_mutex_unlock");
+  }
+
+  for (i = 0; i < nr; i++) {
+    finish_commit_uma(members[i].addr, members[i].len, flags, members[i].uma,
+                      members[i].uma->epoch);
+  }
+  return 0;
+}
+
+/**
+ * @brief 提交之后立即返回，之前的entry全部写回映射文件后由同步线程通知
+ * nvfsync_async <- nvmsync_uma_async
+ */
+int nvmsync_uma_async(void *addr, size_t len, uma_t *uma,
+                      void (*func)(int fd, void *cookie), void *cookie, int fd,
+                      int efd) {
+  unsigned long epoch;
+  int ret;
+
+  ret = nvmsync_uma(addr, len, MS_ASYNC, uma);
+  if (ret != 0) {
+    return ret;
+  }
+
+  /* 并发的fsync可能已经继续增加epoch，等待更新的epoch也满足要求 */
+  epoch = __atomic_load_n(&uma->epoch, __ATOMIC_ACQUIRE);
+  notify_sync_uma(uma, epoch, func, cookie, fd, efd);
+  return 0;
 }
 
 /**
@@ -1117,9 +2049,7 @@ int nvmemcmp(const void *s1, const void *s2, size_t n) {
     uma = find_uma(s1);
 
     if (uma) {
-      increase_uma_read_cnt(uma);
-
-      if (uma->policy == REDO) {
+      if (has_redo_log(s1, n)) {
         s1_ptr = malloc(n);
         if (__glibc_unlikely(s1_ptr == NULL)) handle_error("malloc");
 
@@ -1132,9 +2062,7 @@ int nvmemcmp(const void *s1, const void *s2, size_t n) {
     uma = find_uma(s2);
 
     if (uma) {
-      increase_uma_read_cnt(uma);
-
-      if (uma->policy == REDO) {
+      if (has_redo_log(s2, n)) {
         s2_ptr = malloc(n);
         if (__glibc_unlikely(s2_ptr == NULL)) handle_error("malloc");
 
@@ -1144,6 +2072,8 @@ int nvmemcmp(const void *s1, const void *s2, size_t n) {
   }
   ret = memcmp(s1_ptr, s2_ptr, n);
 
+  if (s1_ptr != s1) free(s1_ptr);
+  if (s2_ptr != s2) free(s2_ptr);
   return ret;
 }
 
@@ -1184,27 +2114,22 @@ int nvstrcmp(const char *s1, const char *s2) {
   if (filter_addr(s1)) {
     uma = find_uma(s1);
 
-    if (uma) {
-      increase_uma_read_cnt(uma);
-
-      if (uma->policy == REDO) {
-        get_string_from_redo(&s1_ptr, s1);
-      }
+    /* 字符串的长度未知，检查它经过的每个table */
+    if (uma && string_has_redo_log(s1, uma)) {
+      s1_ptr = read_string_from_log(s1, uma);
     }
   }
 
   if (filter_addr(s2)) {
     uma = find_uma(s2);
 
-    if (uma) {
-      increase_uma_read_cnt(uma);
-
-      if (uma->policy == REDO) {
-        get_string_from_redo(&s2_ptr, s2);
-      }
+    if (uma && string_has_redo_log(s2, uma)) {
+      s2_ptr = read_string_from_log(s2, uma);
     }
   }
   ret = strcmp(s1_ptr, s2_ptr);
 
+  if (s1_ptr != s1) free(s1_ptr);
+  if (s2_ptr != s2) free(s2_ptr);
   return ret;
 }
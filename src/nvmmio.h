@@ -6,8 +6,18 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include "uma.h"
 
+/**
+ * @brief 组提交中的一个文件
+ */
+typedef struct nvmsync_member_struct {
+  void *addr;
+  size_t len;
+  struct mmap_area_struct *uma;
+} nvmsync_member_t;
+
 void init_libnvmmio(void);
 
 /* Memory mapped file I/O interfaces */
@@ -23,9 +33,21 @@ char *nvstrchr(const char *s, int c);
 void nvmmio_memcpy(void *, const void *, size_t);
 void nvmemcpy_write(void *, const void *, size_t, struct mmap_area_struct *);
 void nvmemcpy_read_redo(void *, const void *, size_t);
+size_t nvmemcpy_read_zc(const void *, size_t, struct iovec *, int *,
+                        struct mmap_area_struct *);
+void pin_uma_logs(struct mmap_area_struct *);
+void unpin_uma_logs(struct mmap_area_struct *);
+void nvmemcpy_append(void *, const void *, size_t);
+void set_uma_file_size(struct mmap_area_struct *, unsigned long);
+unsigned long get_uma_file_size(struct mmap_area_struct *);
+void extend_uma_file_size(struct mmap_area_struct *, unsigned long);
 int nvmsync_uma(void *, size_t, int, uma_t *);
+int nvmabort_uma(uma_t *);
+int nvmsync_group(nvmsync_member_t *, int, int);
+int nvmsync_uma_async(void *, size_t, uma_t *, void (*)(int, void *), void *,
+                      int, int);
 int nvmunmap_uma(void *, size_t, struct mmap_area_struct *);
-void close_sync_thread(struct mmap_area_struct *);
+unsigned long sync_uma(struct mmap_area_struct *);
 
 #ifdef __cplusplus
 }
@@ -4,11 +4,16 @@
 #include <sys/mman.h>
 #include <dirent.h>
 #include <errno.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/uio.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -22,7 +27,9 @@
 #endif
 
 #define IO_MAP_SIZE (1UL << 32) /* 1GB */
-#define FD_LIMIT 1024
+#define FD_SHARD_SHIFT (10)
+#define FD_SHARD_SIZE (1UL << FD_SHARD_SHIFT) /* 每个分片的fd个数 */
+#define FD_MAX_LIMIT (1UL << 20) /* RLIMIT_NOFILE不受限时的上限 */
 #define PATH_SIZE 64
 #define NthM(x) (67108864 << x) // 64M
 
@@ -40,55 +47,227 @@ typedef struct fd_mapaddr_struct {
   size_t written_file_size; // 映射文件的有效数据长度
   size_t current_file_size; // 文件在nvm上的大小
   int dup; // 记录复制的文件描述符次数
-  int dupfd;  // 指示当前的fd是否是dup来的。如果fd_table[fd].dupfd != fd.则说明通过调用nvdup产生的fd。
+  int dupfd;  // 指示当前的fd是否是dup来的。如果fd_entry(fd)->dupfd != fd.则说明通过调用nvdup产生的fd。
   int open; // 文件被打开的次数，即打开同一文件产生的不同的文件描述符的个数（不包括dup）
   int increaseCount;  // 文件在nvm上空间扩展的次数，初始值为1
+  int indirection; // 文件第一次被打开时的fd，文件相关的数据都记录在它的表项中
+  bool append; // fd以O_APPEND打开
+  size_t append_size; // 已经预留给追加写的文件长度
+  unsigned long append_gen; // 截断或放弃事务时增加，取消还没有发布的预留区间
+  size_t tx_file_size; // nvtx_begin()时的有效数据长度，nvtx_abort()时恢复
   uma_t *fd_uma;
+  pthread_rwlock_t map_lock; // 读写映射文件时持有读锁，扩展并重新映射时持有写锁
 } fd_addr;
 
 /**
  * @brief 用于查找
- * 
+ *
+ * fd表按FD_SHARD_SIZE分片，分片数由RLIMIT_NOFILE的硬上限决定，
+ * 分片在其中的fd第一次被使用时才分配
  */
-static fd_addr fd_table[FD_LIMIT] = {0,};
-static int fd_indirection[FD_LIMIT] = {0};
+static fd_addr **fd_table = NULL;
+static unsigned long nr_fd_shards;
+static pthread_once_t fd_table_once = PTHREAD_ONCE_INIT;
 static int lastFd;
 
 int POSSIBLE_MODE = S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP |
                     S_IROTH | S_IWOTH | S_IXOTH;
 
+static void init_fd_table(void) {
+  struct rlimit rlim;
+  unsigned long nr_fds;
+
+  if (__glibc_unlikely(getrlimit(RLIMIT_NOFILE, &rlim) != 0)) {
+    handle_error("getrlimit");
+  }
+
+  nr_fds = rlim.rlim_max;
+  if (rlim.rlim_max == RLIM_INFINITY || nr_fds > FD_MAX_LIMIT) {
+    nr_fds = FD_MAX_LIMIT;
+  }
+  nr_fd_shards = (nr_fds + FD_SHARD_SIZE - 1) >> FD_SHARD_SHIFT;
+
+  fd_table = (fd_addr **)calloc(nr_fd_shards, sizeof(fd_addr *));
+  if (__glibc_unlikely(fd_table == NULL)) {
+    handle_error("calloc");
+  }
+  LIBNVMMIO_DEBUG("%lu fds, %lu shards", nr_fds, nr_fd_shards);
+}
+
+static fd_addr *alloc_fd_shard(unsigned long index) {
+  fd_addr *shard;
+  unsigned long i;
+  int s;
+
+  shard = (fd_addr *)calloc(FD_SHARD_SIZE, sizeof(fd_addr));
+  if (__glibc_unlikely(shard == NULL)) {
+    handle_error("calloc");
+  }
+
+  for (i = 0; i < FD_SHARD_SIZE; i++) {
+    s = pthread_rwlock_init(&shard[i].map_lock, NULL);
+    if (__glibc_unlikely(s != 0)) {
+      handle_error("pthread_rwlock_init");
+    }
+  }
+
+  /* 其他线程可能同时分配了同一个分片 */
+  if (!__sync_bool_compare_and_swap(&fd_table[index], NULL, shard)) {
+    free(shard);
+  }
+  return fd_table[index];
+}
+
+/**
+ * @brief 返回fd对应的表项
+ */
+static inline fd_addr *fd_entry(int fd) {
+  unsigned long index = (unsigned long)fd >> FD_SHARD_SHIFT;
+  fd_addr *shard;
+
+  if (__glibc_unlikely(fd_table == NULL)) {
+    pthread_once(&fd_table_once, init_fd_table);
+  }
+
+  if (__glibc_unlikely(index >= nr_fd_shards)) {
+    handle_error_en(EMFILE, "fd_entry");
+  }
+
+  shard = __atomic_load_n(&fd_table[index], __ATOMIC_ACQUIRE);
+  if (__glibc_unlikely(shard == NULL)) {
+    shard = alloc_fd_shard(index);
+  }
+  return &shard[fd & (FD_SHARD_SIZE - 1)];
+}
+
+/**
+ * @brief 返回fd所指文件的表项
+ */
+static inline fd_addr *file_entry(int fd) {
+  return fd_entry(fd_entry(fd)->indirection);
+}
+
+/**
+ * @brief 返回记录fd读写位置的表项，dup得到的fd与原fd共享读写位置
+ */
+static inline fd_addr *off_entry(int fd) {
+  fd_addr *entry = fd_entry(fd);
+
+  if (entry->dupfd == fd) {
+    return entry;
+  }
+  return fd_entry(entry->indirection);
+}
+
+/**
+ * @brief 读写映射文件之前持有文件的读锁，期间映射地址和uma不会改变
+ */
+static inline void read_lock_map(int fd) {
+  int s;
+
+  s = pthread_rwlock_rdlock(&file_entry(fd)->map_lock);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_rwlock_rdlock");
+  }
+}
+
+static inline void write_lock_map(int fd) {
+  int s;
+
+  s = pthread_rwlock_wrlock(&file_entry(fd)->map_lock);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_rwlock_wrlock");
+  }
+}
+
+static inline void unlock_map(int fd) {
+  int s;
+
+  s = pthread_rwlock_unlock(&file_entry(fd)->map_lock);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error("pthread_rwlock_unlock");
+  }
+}
+
+/**
+ * @brief 原子地移动读写位置，返回移动前的位置，并发的读写得到互不重叠的区间
+ */
+static inline off_t advance_fd_off(int fd, off_t cnt) {
+  return __sync_fetch_and_add(&off_entry(fd)->off, cnt);
+}
+
+/**
+ * @brief 有效数据长度只增不减，并发写入时取最大值
+ */
+static inline void update_written_size(int fd, size_t size) {
+  fd_addr *entry = file_entry(fd);
+  size_t old;
+
+  old = entry->written_file_size;
+  while (old < size) {
+    if (__sync_bool_compare_and_swap(&entry->written_file_size, old, size)) {
+      extend_uma_file_size(entry->fd_uma, size);
+      break;
+    }
+    old = entry->written_file_size;
+  }
+}
+
+/**
+ * @brief 在文件末尾预留cnt字节给追加写，返回预留区间的起始位置
+ */
+static inline off_t reserve_append(int fd, size_t cnt) {
+  fd_addr *entry = file_entry(fd);
+  size_t old, start;
+
+  do {
+    old = entry->append_size;
+    start = old > entry->written_file_size ? old : entry->written_file_size;
+  } while (!__sync_bool_compare_and_swap(&entry->append_size, old, start + cnt));
+
+  return start;
+}
+
+static inline void update_last_fd(int fd) {
+  int old;
+
+  old = lastFd;
+  while (old < fd) {
+    if (__sync_bool_compare_and_swap(&lastFd, old, fd)) {
+      break;
+    }
+    old = lastFd;
+  }
+}
+
 static inline void map_fd_addr(int fd, void *addr, off_t fd_size,
                                off_t written_file_size, size_t mapped_size,
                                const char *pathname) {
-  fd_table[fd].addr = addr;
-  fd_table[fd].off = 0;
-  memcpy(fd_table[fd].pathname, pathname, strlen(pathname));
-  fd_table[fd].mapped_size = mapped_size;
-  fd_table[fd].written_file_size = written_file_size;
-  fd_table[fd].current_file_size = fd_size;
-  fd_table[fd].fd_uma = find_uma(addr);
-  fd_table[fd].dupfd = fd;
-  fd_table[fd].open = 0;
-  fd_table[fd].dup = 0;
-  fd_table[fd].increaseCount = 1;
-  // TODO
-  // getdtablesize() gives the MAX fd a process can have
-  // not many fds, usually 1024.
-  // Just make an array to keep a fd and addr pair
-}
-
-static inline off_t get_fd_off(int fd) {
-  if (fd_table[fd].dupfd == fd)
-    return fd_table[fd].off;
-  else
-    return fd_table[fd_indirection[fd]].off;
+  fd_addr *entry = fd_entry(fd);
+
+  entry->addr = addr;
+  entry->off = 0;
+  memcpy(entry->pathname, pathname, strlen(pathname));
+  entry->mapped_size = mapped_size;
+  entry->written_file_size = written_file_size;
+  entry->current_file_size = fd_size;
+  entry->fd_uma = find_uma(addr);
+  entry->append_size = written_file_size;
+  entry->tx_file_size = written_file_size;
+  entry->dupfd = fd;
+  entry->open = 0;
+  entry->dup = 0;
+  entry->increaseCount = 1;
+  set_uma_file_size(entry->fd_uma, written_file_size);
 }
+
+static inline off_t get_fd_off(int fd) { return off_entry(fd)->off; }
 static inline void *get_fd_addr_cur(int fd) {
-  return fd_table[fd_indirection[fd]].addr + get_fd_off(fd);
+  return file_entry(fd)->addr + get_fd_off(fd);
 }
 
 static inline void *get_fd_addr_set(int fd, off_t off) {
-  return fd_table[fd_indirection[fd]].addr + off;
+  return file_entry(fd)->addr + off;
 }
 
 static inline uma_t *get_fd_uma(int fd) {
@@ -97,7 +276,7 @@ static inline uma_t *get_fd_uma(int fd) {
   LIBNVMMIO_INIT_TIME(get_fd_uma_time);
   LIBNVMMIO_START_TIME(get_fd_uma_t, get_fd_uma_time);
 
-  uma = fd_table[fd_indirection[fd]].fd_uma;
+  uma = file_entry(fd)->fd_uma;
 
   LIBNVMMIO_END_TIME(get_fd_uma_t, get_fd_uma_time);
   return uma;
@@ -106,9 +285,9 @@ static inline uma_t *get_fd_uma(int fd) {
 static inline int get_path_fd(const char *pathname) {
   int i = 3;
   for (i = 3; i <= lastFd; i++) {
-    if (fd_table[fd_indirection[i]].pathname != NULL &&
-        fd_table[fd_indirection[i]].pathname != 0) {
-      if (strcmp(fd_table[fd_indirection[i]].pathname, pathname) == 0) return i;
+    if (file_entry(i)->pathname != NULL &&
+        file_entry(i)->pathname != 0) {
+      if (strcmp(file_entry(i)->pathname, pathname) == 0) return i;
     }
   }
   return -1;
@@ -119,14 +298,14 @@ static inline int get_path_fd(const char *pathname) {
  * 使file_size = written_file_size
  */
 static inline void trunc_fit_fd(int fd) {
-	size_t written_file_size = fd_table[fd_indirection[fd]].written_file_size;
-	size_t current_file_size = fd_table[fd_indirection[fd]].current_file_size;
+	size_t written_file_size = file_entry(fd)->written_file_size;
+	size_t current_file_size = file_entry(fd)->current_file_size;
 
 	if (written_file_size < current_file_size) {
 		if (ftruncate(fd, written_file_size) < 0) {
 			LIBNVMMIO_DEBUG("ftruncate error");
 		} else {
-			fd_table[fd_indirection[fd]].current_file_size = written_file_size;
+			file_entry(fd)->current_file_size = written_file_size;
 		}
 	}
 }
@@ -138,26 +317,26 @@ static inline void trunc_fit_fd(int fd) {
  */
 static inline size_t trunc_expand_fd(int fd, size_t current_file_size) {
   size_t ret = current_file_size;
-  int indirectedFd = fd_indirection[fd];
+  int indirectedFd = fd_entry(fd)->indirection;
   if (current_file_size < IO_MAP_SIZE) {
     if (posix_fallocate(indirectedFd, 0, IO_MAP_SIZE) < 0) { // 扩展磁盘空间，可以用于申请NVM上的空间？
       LIBNVMMIO_DEBUG("posix_fallocate error");
     } else {
-      fd_table[indirectedFd].current_file_size = IO_MAP_SIZE; // 扩展成功
+      fd_entry(indirectedFd)->current_file_size = IO_MAP_SIZE; // 扩展成功
       ret = IO_MAP_SIZE;
     }
   } else {
     if (current_file_size == IO_MAP_SIZE) return IO_MAP_SIZE;
 
     unsigned long long add_file_size =
-        NthM(fd_table[indirectedFd].increaseCount);
+        NthM(fd_entry(indirectedFd)->increaseCount);
     ret += add_file_size;
-    if (posix_fallocate(indirectedFd, fd_table[indirectedFd].current_file_size,
+    if (posix_fallocate(indirectedFd, fd_entry(indirectedFd)->current_file_size,
                         add_file_size) < 0) {
       LIBNVMMIO_DEBUG("posix_fallocate error");
     } else {  // 扩展成功
-      fd_table[indirectedFd].increaseCount++;
-      fd_table[indirectedFd].current_file_size = ret;
+      fd_entry(indirectedFd)->increaseCount++;
+      fd_entry(indirectedFd)->current_file_size = ret;
     }
   }
   return ret;
@@ -167,34 +346,53 @@ static inline size_t trunc_expand_fd(int fd, size_t current_file_size) {
  * @brief 扩展内存映射文件大小
  * 在unmap之前需要显示调用nvmsync
  * 然后重新建立映射
+ *
+ * 调用者持有读锁，这里换成写锁，返回时重新持有读锁。
+ * 等待写锁期间其他线程可能已经扩展过，因此在写锁下重新检查文件大小
  */
-static inline uma_t *expand_remap_fd(int fd, size_t current_file_size) {
-  int indirectedFd = fd_indirection[fd];
-  size_t ret = trunc_expand_fd(fd, current_file_size);
+static inline uma_t *expand_remap_fd(int fd, size_t required_size) {
+  int indirectedFd = fd_entry(fd)->indirection;
+  unsigned long file_size;
+  size_t ret;
+
+  unlock_map(fd);
+  write_lock_map(fd);
+
+  if (required_size <= fd_entry(indirectedFd)->current_file_size) {
+    goto out;
+  }
+
+  ret = trunc_expand_fd(fd, required_size);
+  file_size = get_uma_file_size(get_fd_uma(fd));
 
   LIBNVMMIO_DEBUG("addr:%ld, len:%ld",
-								 (long int)fd_table[indirectedFd].addr,
-								 fd_table[indirectedFd].written_file_size);
+								 (long int)fd_entry(indirectedFd)->addr,
+								 fd_entry(indirectedFd)->written_file_size);
 
   /* sync */
-  nvmsync(fd_table[indirectedFd].addr, fd_table[indirectedFd].written_file_size,
+  nvmsync(fd_entry(indirectedFd)->addr, fd_entry(indirectedFd)->written_file_size,
           MS_SYNC);
 
-  nvmunmap_uma(fd_table[indirectedFd].addr, fd_table[indirectedFd].mapped_size,
+  nvmunmap_uma(fd_entry(indirectedFd)->addr, fd_entry(indirectedFd)->mapped_size,
                get_fd_uma(fd));
   
   /* 重新建立映射 */
-  fd_table[indirectedFd].addr =
+  fd_entry(indirectedFd)->addr =
       nvmmap(NULL, ret, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
   /* 修改fd_table中对应的数据 */
-  if (fd_table[indirectedFd].addr) {
-    fd_table[indirectedFd].mapped_size = ret;
-    fd_table[indirectedFd].fd_uma = find_uma(fd_table[indirectedFd].addr);
+  if (fd_entry(indirectedFd)->addr) {
+    fd_entry(indirectedFd)->mapped_size = ret;
+    fd_entry(indirectedFd)->fd_uma = find_uma(fd_entry(indirectedFd)->addr);
+    set_uma_file_size(fd_entry(indirectedFd)->fd_uma, file_size);
   } else {
     LIBNVMMIO_DEBUG("Failed!!!");
   }
-  return fd_table[indirectedFd].fd_uma;
+
+out:
+  unlock_map(fd);
+  read_lock_map(fd);
+  return fd_entry(indirectedFd)->fd_uma;
 }
 
 /**
@@ -266,7 +464,7 @@ int nvopen(const char *path, int flags, ...) {
     if (S_ISDIR(statbuf.st_mode) || strncmp(path, "/dev", 4) == 0) {
       isdir = 1;
     } else {
-      fd_size = statbuf.st_size;
+      fd_size = (flags & O_TRUNC) ? 0 : statbuf.st_size;
     }
   }
 
@@ -297,16 +495,17 @@ int nvopen(const char *path, int flags, ...) {
     }
   } else {
     fd = open(path, flags);
-    fd_table[fd].addr = NULL;
-    fd_table[fd].dupfd = fd;
-    fd_indirection[fd] = fd;
-
-    if (lastFd < fd) lastFd = fd;
+    if (fd >= 0) {
+      fd_entry(fd)->addr = NULL;
+      fd_entry(fd)->dupfd = fd;
+      fd_entry(fd)->indirection = fd;
+      update_last_fd(fd);
+    }
     return fd;
   }
 
   if (fd >= 0) {
-    fd_table[fd].addr = NULL;
+    fd_entry(fd)->addr = NULL;
     off_t written_size = fd_size;
     size_t mapped_size;
     void *addr = 0;
@@ -315,12 +514,13 @@ int nvopen(const char *path, int flags, ...) {
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
+    fd_entry(fd)->append = (flags & O_APPEND) != 0;
     if (openedFd > 0) { // 找到对应的openedFd
-      fd_table[fd].off = 0; // 初始化offset
-      fd_table[fd].dupfd = fd;
-      fd_indirection[fd] = openedFd; // 指向文件第一次被打开时的fd
+      fd_entry(fd)->off = 0; // 初始化offset
+      fd_entry(fd)->dupfd = fd;
+      fd_entry(fd)->indirection = openedFd; // 指向文件第一次被打开时的fd
     } else {
-      fd_indirection[fd] = fd;
+      fd_entry(fd)->indirection = fd;
       openedFd = fd;
       mapped_size = trunc_expand_fd(fd, fd_size); // 扩展文件大小
       fd_size = mapped_size;
@@ -328,8 +528,8 @@ int nvopen(const char *path, int flags, ...) {
       if (addr != MAP_FAILED)
         map_fd_addr(fd, addr, fd_size, written_size, mapped_size, path);
     }
-    fd_table[openedFd].open++;
-    if (lastFd < openedFd) lastFd = openedFd;
+    __sync_fetch_and_add(&fd_entry(openedFd)->open, 1);
+    update_last_fd(openedFd);
   } else {
     LIBNVMMIO_DEBUG("open failed for %s fd:%d errno:%d\n", path, fd, errno);
   }
@@ -354,9 +554,13 @@ original_open:
 int nvdup(int oldfd) {
   int newfd = dup(oldfd);
 
-  fd_indirection[newfd] = fd_indirection[oldfd];
-  fd_table[newfd].dupfd = fd_table[oldfd].dupfd;
-  fd_table[fd_table[oldfd].dupfd].dup++;
+  if (newfd < 0) {
+    return newfd;
+  }
+  fd_entry(newfd)->indirection = fd_entry(oldfd)->indirection;
+  fd_entry(newfd)->dupfd = fd_entry(oldfd)->dupfd;
+  fd_entry(newfd)->append = fd_entry(oldfd)->append;
+  __sync_fetch_and_add(&fd_entry(fd_entry(oldfd)->dupfd)->dup, 1);
 
   return newfd;
 }
@@ -371,9 +575,9 @@ int nvdup(int oldfd) {
 void *unmap_thread(void *vargp) {
   int fd = *((int *)vargp);
 
-  nvmsync(fd_table[fd].addr, fd_table[fd].written_file_size, MS_SYNC);
-  nvmunmap_uma(fd_table[fd].addr, fd_table[fd].mapped_size, get_fd_uma(fd));
-  fd_table[fd].addr = NULL;
+  nvmsync(fd_entry(fd)->addr, fd_entry(fd)->written_file_size, MS_SYNC);
+  nvmunmap_uma(fd_entry(fd)->addr, fd_entry(fd)->mapped_size, get_fd_uma(fd));
+  fd_entry(fd)->addr = NULL;
 	return NULL;
 }
 
@@ -382,60 +586,62 @@ void *unmap_thread(void *vargp) {
  */
 int nvclose(int fd) {
   if (get_fd_addr_cur(fd) == NULL) {
-    fd_indirection[fd] = 0;
+    fd_entry(fd)->indirection = 0;
     return close(fd);
   }
 
-  if (fd_table[fd].dupfd != fd) { // 说明是dup而来
-    fd_table[fd_table[fd].dupfd].dup--;
-    if (fd_indirection[fd_table[fd].dupfd] == 0) {// dup的fd已经被关闭
-      if (fd_table[fd_table[fd].dupfd].dup == 0 &&
-          fd_indirection[fd_indirection[fd]] == 0) {
-        if (fd_table[fd_indirection[fd]].open <= 2) {
-          fd_table[fd].dupfd = 0;
+  if (fd_entry(fd)->dupfd != fd) { // 说明是dup而来
+    fd_entry(fd_entry(fd)->dupfd)->dup--;
+    if (fd_entry(fd_entry(fd)->dupfd)->indirection == 0) {// dup的fd已经被关闭
+      if (fd_entry(fd_entry(fd)->dupfd)->dup == 0 &&
+          fd_entry(fd_entry(fd)->indirection)->indirection == 0) {
+        if (file_entry(fd)->open <= 2) {
+          fd_entry(fd)->dupfd = 0;
           LIBNVMMIO_DEBUG("goto");
           goto removeOriginalFd;
         } else
-          fd_table[fd_indirection[fd]].open--;
+          file_entry(fd)->open--;
       }
     }
-    fd_table[fd].dupfd = 0;
-  } else if (fd_table[fd_indirection[fd]].open > 1) {
-    if (fd_table[fd].dup == 0) {// 该fd未被复制
-      fd_table[fd_indirection[fd]].open--;
-      fd_table[fd].off = 0;
-      fd_table[fd].dupfd = 0; // 标志该fd无效?
+    fd_entry(fd)->dupfd = 0;
+  } else if (file_entry(fd)->open > 1) {
+    if (fd_entry(fd)->dup == 0) {// 该fd未被复制
+      file_entry(fd)->open--;
+      fd_entry(fd)->off = 0;
+      fd_entry(fd)->dupfd = 0; // 标志该fd无效?
     }
-  } else if (fd_table[fd].dup == 0) {// 该fd未被复制
+  } else if (fd_entry(fd)->dup == 0) {// 该fd未被复制
     void *addr;
     //size_t mapped_size;
   removeOriginalFd:// 删除原始的fd
-    addr = fd_table[fd_indirection[fd]].addr;
-    //mapped_size = fd_table[fd_indirection[fd]].mapped_size;
+    /* 等待未释放的lease，之后没有span指向要解除的映射 */
+    write_lock_map(fd);
+    addr = file_entry(fd)->addr;
+    //mapped_size = file_entry(fd)->mapped_size;
     trunc_fit_fd(fd);
-    close_sync_thread(fd_table[fd_indirection[fd]].fd_uma);// 关闭后台同步线程
 
-    nvmsync_uma(addr, fd_table[fd_indirection[fd]].written_file_size, MS_SYNC,
+    nvmsync_uma(addr, file_entry(fd)->written_file_size, MS_SYNC,
                 get_fd_uma(fd));
     // 取消文件映射
-    nvmunmap_uma(fd_table[fd_indirection[fd]].addr,
-                 fd_table[fd_indirection[fd]].mapped_size, get_fd_uma(fd));
-
-    fd_table[fd_indirection[fd]].addr = NULL;
-    fd_table[fd_indirection[fd]].off = 0;
-    memset(fd_table[fd_indirection[fd]].pathname, 0, PATH_SIZE);
-    fd_table[fd_indirection[fd]].mapped_size = 0;
-    fd_table[fd_indirection[fd]].written_file_size = 0;
-    fd_table[fd_indirection[fd]].current_file_size = 0;
-    fd_table[fd_indirection[fd]].fd_uma = NULL;
-    fd_table[fd_indirection[fd]].open = 0;
-    fd_table[fd_indirection[fd]].dup = 0;
-    fd_table[fd_indirection[fd]].dupfd = 0;
-    fd_table[fd_indirection[fd]].increaseCount = 0;
+    nvmunmap_uma(file_entry(fd)->addr,
+                 file_entry(fd)->mapped_size, get_fd_uma(fd));
+
+    file_entry(fd)->addr = NULL;
+    file_entry(fd)->off = 0;
+    memset(file_entry(fd)->pathname, 0, PATH_SIZE);
+    file_entry(fd)->mapped_size = 0;
+    file_entry(fd)->written_file_size = 0;
+    file_entry(fd)->current_file_size = 0;
+    file_entry(fd)->fd_uma = NULL;
+    file_entry(fd)->open = 0;
+    file_entry(fd)->dup = 0;
+    file_entry(fd)->dupfd = 0;
+    file_entry(fd)->increaseCount = 0;
+    unlock_map(fd);
   } else {
-    fd_table[fd_indirection[fd]].open--;
+    file_entry(fd)->open--;
   }
-  fd_indirection[fd] = 0;
+  fd_entry(fd)->indirection = 0;
 
   return close(fd);
 }
@@ -456,7 +662,7 @@ static inline ssize_t pwriteToMap(int fd, const void *buf, size_t cnt,
   uma_t *dst_uma = get_fd_uma(fd);
 
   /*
-     if(fd_table[fd].addr == NULL){
+     if(fd_entry(fd)->addr == NULL){
   //printf("[%s]: Invalid write request from fd %d\n",__func__, fd);
   }
    */
@@ -464,24 +670,80 @@ static inline ssize_t pwriteToMap(int fd, const void *buf, size_t cnt,
     // TODO Check if trunc_fit_fd is needed in libnvmmio mmap semantic
     // trunc_fit_fd(fd);
     unsigned long required_size =
-        cnt + (dst - fd_table[fd_indirection[fd]].addr);
-    if (required_size > fd_table[fd_indirection[fd]].current_file_size) {
+        cnt + (dst - file_entry(fd)->addr);
+    if (required_size > file_entry(fd)->current_file_size) {
       LIBNVMMIO_DEBUG("call expand remap fd current size:%ld required size:%lu",
-                    fd_table[fd_indirection[fd]].current_file_size,
+                    file_entry(fd)->current_file_size,
                     required_size);
+      off_t off = dst - file_entry(fd)->addr;
+
       dst_uma = expand_remap_fd(fd, required_size);
-      dst = get_fd_addr_cur(fd);  // required_size + fd_table[fd_indirection[fd]].addr;
+      dst = get_fd_addr_set(fd, off); // 重新映射后地址改变，偏移不变
     }
     /* write 次数加1 */
     increase_uma_write_cnt(dst_uma);
 
     nvmemcpy_write(dst, buf, cnt, dst_uma);
   } else {
-    LIBNVMMIO_DEBUG("dst_uma for fd %d->%d  doesn't exist", fd, fd_indirection[fd]);
+    LIBNVMMIO_DEBUG("dst_uma for fd %d->%d  doesn't exist", fd, fd_entry(fd)->indirection);
   }
   return cnt;
 }
 
+/**
+ * @brief 以O_APPEND方式写入iov中共cnt字节，返回写入的位置
+ *
+ * 文件末尾之后的区域没有旧数据，不需要log，直接写入映射文件，
+ * 新的文件长度在下一次提交时持久化，写入的数据只被拷贝一次。
+ * 截断或放弃事务会取消还没有发布的预留区间，这时在新的文件末尾重新预留并写入
+ */
+static inline off_t appendToMap(int fd, const struct iovec *iov, int iovcnt,
+                                size_t cnt) {
+  fd_addr *entry = file_entry(fd);
+  unsigned long gen;
+  uma_t *dst_uma;
+  size_t done;
+  off_t off;
+  int i;
+
+appendToMap_reserve:
+  /* 持有读锁期间append_gen不会改变 */
+  gen = entry->append_gen;
+  off = reserve_append(fd, cnt);
+
+  dst_uma = get_fd_uma(fd);
+  if (off + cnt > entry->current_file_size) {
+    LIBNVMMIO_DEBUG("call expand remap fd current size:%ld required size:%lu",
+                    entry->current_file_size, off + cnt);
+    dst_uma = expand_remap_fd(fd, off + cnt);
+    if (entry->append_gen != gen) {
+      goto appendToMap_reserve;
+    }
+  }
+  increase_uma_write_cnt(dst_uma);
+
+  for (i = 0, done = 0; i < iovcnt; done += iov[i].iov_len, i++) {
+    nvmemcpy_append(get_fd_addr_set(fd, off + done), iov[i].iov_base,
+                    iov[i].iov_len);
+  }
+
+  /*
+   * 之前预留的区间都写完后才能延长文件，保证文件长度之内没有未写完的数据。
+   * 之前的区间可能要重新映射，等待时释放读锁，之后的uma要重新查找
+   */
+  while (__atomic_load_n(&entry->written_file_size, __ATOMIC_ACQUIRE) <
+         (size_t)off) {
+    unlock_map(fd);
+    sched_yield();
+    read_lock_map(fd);
+    if (entry->append_gen != gen) {
+      goto appendToMap_reserve;
+    }
+  }
+  update_written_size(fd, off + cnt);
+  return off;
+}
+
 /**
  * @brief 读取src处的cnt字节的数据到buf中
  * 
@@ -495,19 +757,14 @@ static inline ssize_t preadFromMap(int fd, void *buf, size_t cnt, void *src) {
   uma_t *src_uma = get_fd_uma(fd);
 
   /*
-     if(fd_table[fd_indirection[fd]].addr == NULL){
+     if(file_entry(fd)->addr == NULL){
   //printf("[%s]: Invalid read request from fd %d\n",__func__, fd);
   }
    */
 
   if (src_uma) {
-    increase_uma_read_cnt(src_uma);
-    if (src_uma->policy == UNDO) {
-      nvmmio_memcpy(buf, src, cnt); // undo策略由于是就地写，可以直接读取
-      return cnt;
-    } else {
-      nvmemcpy_read_redo(buf, src, cnt);// 从redo log中读取
-    }
+    /* UNDO table就地写，直接从映射文件读取；REDO table从log中读取 */
+    nvmemcpy_read_redo(buf, src, cnt);
   }
   return cnt;
 }
@@ -521,19 +778,17 @@ static inline ssize_t preadFromMap(int fd, void *buf, size_t cnt, void *src) {
  * @return ssize_t 
  */
 ssize_t nvread(int fd, void *buf, size_t cnt) {
-  void *src = get_fd_addr_cur(fd);
-  if (src == NULL) {
+  if (file_entry(fd)->addr == NULL) {
     //	printf("[%s] Called write with unmapped fd %d\\n", __func__, fd);
     return read(fd, buf, cnt);
   }
-  ssize_t ret = preadFromMap(fd, buf, cnt, src);
-  if (fd_table[fd].dupfd == fd) { // 不是被复制的fd
-    fd_table[fd].off += cnt;
-  } else {
-    // TODO: 编码试试dup和reopen的差别
-    fd_table[fd_indirection[fd]].off += cnt;// CONFUSE：为什么不是fd_table[fd_table[fd].dupfd].off += cnt?
-  }
+  /* 先占用[off, off + cnt)，并发的nvread读到不同的区间 */
+  off_t off = advance_fd_off(fd, cnt);
+  ssize_t ret;
 
+  read_lock_map(fd);
+  ret = preadFromMap(fd, buf, cnt, get_fd_addr_set(fd, off));
+  unlock_map(fd);
   return ret;
 }
 
@@ -546,29 +801,30 @@ ssize_t nvread(int fd, void *buf, size_t cnt) {
  * @return ssize_t 
  */
 ssize_t nvwrite(int fd, const void *buf, size_t cnt) {
-  void *dst;
-
-  dst = get_fd_addr_cur(fd);
-
-  if (dst == NULL) {
+  if (file_entry(fd)->addr == NULL) {
     // printf("[%s] Called write with unmapped fd %d\\n", __func__, fd);
     return write(fd, buf, cnt);
   }
-  ssize_t ret = pwriteToMap(fd, buf, cnt, dst);
-
-  // printf("\t\t\t[%s]: write Length:%ld fd:%d\n", __func__, cnt, fd);
   off_t off;
-  if (fd_table[fd].dupfd == fd) {
-    fd_table[fd].off += cnt;
-    off = fd_table[fd].off;
-  } else {
-    fd_table[fd_indirection[fd]].off += cnt;
-    off = fd_table[fd_indirection[fd]].off;
-  }
-  if ((size_t)off > fd_table[fd_indirection[fd]].written_file_size) {
-    fd_table[fd_indirection[fd]].written_file_size = (size_t)off;
+  ssize_t ret;
+
+  read_lock_map(fd);
+  if (fd_entry(fd)->append) {
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = cnt};
+
+    off = appendToMap(fd, &iov, 1, cnt);
+    unlock_map(fd);
+
+    /* O_APPEND写入后读写位置位于写入数据之后 */
+    __atomic_store_n(&off_entry(fd)->off, off + cnt, __ATOMIC_RELAXED);
+    return cnt;
   }
+  /* 先占用[off, off + cnt)，并发的nvwrite写入不同的区间 */
+  off = advance_fd_off(fd, cnt);
+  ret = pwriteToMap(fd, buf, cnt, get_fd_addr_set(fd, off));
 
+  update_written_size(fd, off + cnt);
+  unlock_map(fd);
   return ret;
 }
 
@@ -577,33 +833,16 @@ off_t nvlseek(int fd, off_t offset, int whence) {
   switch (whence) {
     case SEEK_SET:// 参数offset 即为新的读写位置
       // validate offset range
-      if (fd_table[fd].dupfd == fd)
-        fd_table[fd].off = offset;
-      else
-        fd_table[fd_indirection[fd]].off = offset;
-
+      __atomic_store_n(&off_entry(fd)->off, offset, __ATOMIC_RELAXED);
       return offset;
 
     case SEEK_CUR:// SEEK_CUR 以目前的读写位置往后增加offset 个位移量
-      if (fd_indirection[fd] == 0) return -1;
-      if (fd_table[fd].dupfd == fd) {
-        fd_table[fd].off += offset;
-        off = fd_table[fd].off;
-      } else {
-        fd_table[fd_indirection[fd]].off += offset;
-        off = fd_table[fd_indirection[fd]].off;
-      }
-      return off;
+      if (fd_entry(fd)->indirection == 0) return -1;
+      return advance_fd_off(fd, offset) + offset;
 
     case SEEK_END:  // 将读写位置指向文件尾后再增加offset 个位移量.
-      if (fd_table[fd].dupfd == fd) {
-        fd_table[fd].off = fd_table[fd].written_file_size + offset;
-        off = fd_table[fd].off;
-      } else {
-        fd_table[fd_indirection[fd]].off =
-            fd_table[fd].written_file_size + offset;
-        off = fd_table[fd_indirection[fd]].off;
-      }
+      off = file_entry(fd)->written_file_size + offset;
+      __atomic_store_n(&off_entry(fd)->off, off, __ATOMIC_RELAXED);
       return off;
 
     default:
@@ -616,12 +855,29 @@ off_t nvlseek(int fd, off_t offset, int whence) {
  * @brief 修改文件大小
  */
 int nvftruncate(int fd, off_t length) {
-  int ret = ftruncate(fd, length);
+  fd_addr *entry = file_entry(fd);
+  int ret;
+
+  write_lock_map(fd);
+
+  /* 追加写不经过log，截断前要先把被截掉部分的log写回，
+   * 否则之后的同步会用旧数据覆盖新追加的数据 */
+  if (entry->addr != NULL && (size_t)length < entry->written_file_size) {
+    nvmsync_uma(entry->addr, entry->written_file_size, MS_SYNC, entry->fd_uma);
+  }
+
+  ret = ftruncate(fd, length);
   if (ret == 0) {
-    fd_table[fd_indirection[fd]].written_file_size = length;
-    fd_table[fd_indirection[fd]].current_file_size = length;
+    entry->written_file_size = length;
+    entry->current_file_size = length;
+    entry->append_size = length;
+    entry->append_gen++; /* 等待发布的追加写在新的文件末尾重新预留 */
+    if (entry->addr != NULL) {
+      set_uma_file_size(entry->fd_uma, length);
+    }
     // TODO check sparse file is posix standard
   }
+  unlock_map(fd);
 
   return ret;
 }
@@ -630,18 +886,146 @@ int nvftruncate(int fd, off_t length) {
  * @brief 同步，对于ummaped文件，调用fsync，否则调用nvmsync_uma
  */
 int nvfsync(int fd) {
-  int indirectedFd = fd_indirection[fd];
+  int indirectedFd = fd_entry(fd)->indirection;
   if (get_fd_addr_cur(fd) == NULL) {
     return fsync(fd);
   }
   // trunc_fit_fd(fd);
-  // printf("[%s]:addr:%ld, len:%ld\n",__func__,(long int)fd_table[fd].addr,
-  // fd_table[fd].written_file_size);
-  return nvmsync_uma(fd_table[indirectedFd].addr,
-                     fd_table[indirectedFd].written_file_size, MS_ASYNC,
+  // printf("[%s]:addr:%ld, len:%ld\n",__func__,(long int)fd_entry(fd)->addr,
+  // fd_entry(fd)->written_file_size);
+  return nvmsync_uma(fd_entry(indirectedFd)->addr,
+                     fd_entry(indirectedFd)->written_file_size, MS_ASYNC,
                      get_fd_uma(fd));
 }
 
+/**
+ * @brief 开始一个事务，先提交之前的写入，事务只包含之后的写入
+ * 事务以文件为单位，期间其他线程对同一文件的写入也属于该事务
+ */
+int nvtx_begin(int fd) {
+  int indirectedFd = fd_entry(fd)->indirection;
+
+  if (get_fd_addr_cur(fd) == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  file_entry(fd)->tx_file_size = file_entry(fd)->written_file_size;
+
+  return nvmsync_uma(fd_entry(indirectedFd)->addr,
+                     fd_entry(indirectedFd)->written_file_size, MS_ASYNC,
+                     get_fd_uma(fd));
+}
+
+/**
+ * @brief 提交事务，只增加epoch，写回由同步线程完成
+ */
+int nvtx_commit(int fd) {
+  if (get_fd_addr_cur(fd) == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  return nvfsync(fd);
+}
+
+/**
+ * @brief 放弃事务，丢弃nvtx_begin()之后的写入，并恢复文件长度
+ */
+int nvtx_abort(int fd) {
+  fd_addr *entry = file_entry(fd);
+  int ret;
+
+  if (get_fd_addr_cur(fd) == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* 与截断一样取消等待发布的追加写 */
+  write_lock_map(fd);
+  ret = nvmabort_uma(entry->fd_uma);
+  if (ret != 0) {
+    unlock_map(fd);
+    return ret;
+  }
+
+  if (entry->written_file_size > entry->tx_file_size) {
+    entry->written_file_size = entry->tx_file_size;
+    entry->append_size = entry->tx_file_size;
+    entry->append_gen++;
+    if (get_uma_file_size(entry->fd_uma) != UMA_FILE_SIZE_UNKNOWN) {
+      set_uma_file_size(entry->fd_uma, entry->tx_file_size);
+    }
+  }
+  unlock_map(fd);
+  return 0;
+}
+
+/**
+ * @brief 组提交，fds中的文件要么全部提交要么全部未提交
+ * 没有映射的文件不参与组提交，直接调用fsync
+ */
+int nvfsync_group(const int *fds, int nr) {
+  nvmsync_member_t *members;
+  int i, fd, n = 0, ret;
+
+  if (fds == NULL || nr <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  members = (nvmsync_member_t *)malloc((size_t)nr * sizeof(nvmsync_member_t));
+  if (__glibc_unlikely(members == NULL)) {
+    handle_error("malloc");
+  }
+
+  for (i = 0; i < nr; i++) {
+    if (get_fd_addr_cur(fds[i]) == NULL) {
+      if (fsync(fds[i]) != 0) {
+        free(members);
+        return -1;
+      }
+      continue;
+    }
+    fd = fd_entry(fds[i])->indirection;
+    members[n].addr = fd_entry(fd)->addr;
+    members[n].len = fd_entry(fd)->written_file_size;
+    members[n].uma = get_fd_uma(fds[i]);
+    n++;
+  }
+
+  ret = nvmsync_group(members, n, MS_ASYNC);
+  free(members);
+  return ret;
+}
+
+/**
+ * @brief 异步同步，提交后立即返回，写回完成后调用cb并向efd写1
+ * cb一般在同步线程中调用，已经全部写回或fd没有映射时在返回之前由当前线程调用，
+ * 因此cb中不能再获取调用nvfsync_async()时持有的锁。不需要时传NULL；
+ * efd小于0时不使用eventfd
+ */
+int nvfsync_async(int fd, nvfsync_cb_t cb, void *cookie, int efd) {
+  int indirectedFd = fd_entry(fd)->indirection;
+  uint64_t one = 1;
+  int ret;
+
+  if (get_fd_addr_cur(fd) == NULL) {
+    ret = fsync(fd);
+    if (ret == 0) {
+      if (cb != NULL) {
+        cb(fd, cookie);
+      }
+      if (efd >= 0 && write(efd, &one, sizeof(one)) != sizeof(one)) {
+        return -1;
+      }
+    }
+    return ret;
+  }
+
+  return nvmsync_uma_async(fd_entry(indirectedFd)->addr,
+                           fd_entry(indirectedFd)->written_file_size,
+                           get_fd_uma(fd), cb, cookie, fd, efd);
+}
+
 // pread does not change offset
 /**
  * @brief  read并指定offset
@@ -651,15 +1035,82 @@ ssize_t nvpread(int fd, void *buf, size_t cnt, off_t offset) {
     //	printf("[%s] Called write with unmapped fd %d\\n", __func__, fd);
     return pread(fd, buf, cnt, offset);
   }
-  void *src = get_fd_addr_set(fd, offset);
-  ssize_t ret = preadFromMap(fd, buf, cnt, src);
+  ssize_t ret;
 
+  read_lock_map(fd);
+  ret = preadFromMap(fd, buf, cnt, get_fd_addr_set(fd, offset));
+  unlock_map(fd);
   return ret;
 }
 ssize_t nvpread64(int fd, void *buf, size_t cnt, off_t offset) {
   return nvpread(fd, buf, cnt, offset);
 }
 
+/**
+ * @brief 零拷贝pread，span指向映射文件或log数据
+ * lease持有文件映射的读锁直到释放，期间其他线程扩展、截断或关闭文件时等待，
+ * span一直有效；持有lease的线程自己扩展、截断或关闭该文件会死锁。
+ * 并发写入同一区域时span中的数据可能随之改变
+ *
+ * @param spans 返回的span数组
+ * @param nr_spans 传入spans的个数，返回使用的个数
+ * @param lease 成功时必须用nvpread_zc_release()释放
+ * @return span覆盖的字节数，span不够时小于cnt，到达文件末尾时为0
+ */
+ssize_t nvpread_zc(int fd, size_t cnt, off_t offset, struct iovec *spans,
+                   int *nr_spans, nvlease_t *lease) {
+  uma_t *uma;
+  size_t size;
+  ssize_t ret;
+
+  lease->uma = NULL;
+  lease->map_lock = NULL;
+
+  if (file_entry(fd)->addr == NULL || *nr_spans <= 0 || offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  size = file_entry(fd)->written_file_size;
+  if ((size_t)offset >= size || cnt == 0) {
+    *nr_spans = 0;
+    return 0;
+  }
+  if (cnt > size - offset) {
+    cnt = size - offset;
+  }
+
+  read_lock_map(fd);
+  uma = get_fd_uma(fd);
+
+  /* 先持有lease再查找log，之后同步线程不会回收读到的log数据 */
+  pin_uma_logs(uma);
+  lease->uma = uma;
+
+  ret = nvmemcpy_read_zc(get_fd_addr_set(fd, offset), cnt, spans, nr_spans,
+                         uma);
+
+  /* span指向当前的映射，读锁交给lease，释放时才允许重新映射 */
+  lease->map_lock = &file_entry(fd)->map_lock;
+  return ret;
+}
+
+void nvpread_zc_release(nvlease_t *lease) {
+  int s;
+
+  if (lease->uma != NULL) {
+    unpin_uma_logs(lease->uma);
+    lease->uma = NULL;
+  }
+  if (lease->map_lock != NULL) {
+    s = pthread_rwlock_unlock((pthread_rwlock_t *)lease->map_lock);
+    if (__glibc_unlikely(s != 0)) {
+      handle_error("pthread_rwlock_unlock");
+    }
+    lease->map_lock = NULL;
+  }
+}
+
 /**
  * @brief write但不更新offset
  */
@@ -667,13 +1118,13 @@ ssize_t nvpwrite(int fd, const void *buf, size_t cnt, off_t offset) {
   if (get_fd_addr_cur(fd) == NULL) {
     return pwrite(fd, buf, cnt, offset);
   }
-  ssize_t ret = pwriteToMap(fd, buf, cnt, get_fd_addr_set(fd, offset));
+  ssize_t ret;
 
-  off_t written_size = offset + cnt;
-  if ((size_t)written_size > fd_table[fd_indirection[fd]].written_file_size) {
-    fd_table[fd_indirection[fd]].written_file_size = written_size;
-  }
+  read_lock_map(fd);
+  ret = pwriteToMap(fd, buf, cnt, get_fd_addr_set(fd, offset));
 
+  update_written_size(fd, offset + cnt);
+  unlock_map(fd);
   return ret;
 }
 ssize_t nvpwrite64(int fd, const void *buf, size_t cnt, off_t offset) {
@@ -689,14 +1140,16 @@ ssize_t nvpreadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
   int i;
   ssize_t ret = 0;
   if (get_fd_addr_cur(fd) == NULL) {
-    return preadv(fd_indirection[fd], iov, iovcnt, offset);
+    return preadv(fd_entry(fd)->indirection, iov, iovcnt, offset);
   }
+  read_lock_map(fd);
   void *src = get_fd_addr_set(fd, offset);
 
   for (i = 0; i < iovcnt; i++) {
     ret += preadFromMap(fd, iov[i].iov_base, iov[i].iov_len, src);
     src += iov[i].iov_len;
   }
+  unlock_map(fd);
 
   return ret;
 }
@@ -709,24 +1162,17 @@ ssize_t nvpwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
     return pwritev(fd, iov, iovcnt, offset);
   }
   int i;
-  ssize_t ret = 0, file_size = fd_table[fd_indirection[fd]].current_file_size,
-          len = offset;
-  void *dst = get_fd_addr_set(fd, offset);
+  ssize_t ret = 0;
 
+  /* 文件空间不足时pwriteToMap会扩展并重新映射，每次都重新计算地址 */
+  read_lock_map(fd);
   for (i = 0; i < iovcnt; i++) {
-    len += iov[i].iov_len;
-    if (len > file_size) {
-      expand_remap_fd(fd, file_size);
-    }
-    ret += pwriteToMap(fd, iov[i].iov_base, iov[i].iov_len, dst);
-    dst += iov[i].iov_len;
-  }
-
-  off_t written_size = offset + ret;
-  if (written_size > file_size) {
-    fd_table[fd_indirection[fd]].written_file_size = written_size;
+    ret += pwriteToMap(fd, iov[i].iov_base, iov[i].iov_len,
+                       get_fd_addr_set(fd, offset + ret));
   }
 
+  update_written_size(fd, offset + ret);
+  unlock_map(fd);
   return ret;
 }
 
@@ -736,21 +1182,26 @@ ssize_t nvpwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
 ssize_t nvreadv(int fd, const struct iovec *iov, int iovcnt) {
   int i;
   ssize_t ret = 0;
-  void *src = get_fd_addr_cur(fd);
-  if (src == NULL) {
+  size_t cnt = 0;
+  off_t off;
+  void *src;
+  if (file_entry(fd)->addr == NULL) {
     //	printf("[%s] Called write with unmapped fd %d\\n", __func__, fd);
     return readv(fd, iov, iovcnt);
   }
 
+  for (i = 0; i < iovcnt; i++) {
+    cnt += iov[i].iov_len;
+  }
+  off = advance_fd_off(fd, cnt);
+
+  read_lock_map(fd);
+  src = get_fd_addr_set(fd, off);
   for (i = 0; i < iovcnt; i++) {
     ret += preadFromMap(fd, iov[i].iov_base, iov[i].iov_len, src);
     src += iov[i].iov_len;
   }
-
-  if (fd_table[fd].dupfd == fd)
-    fd_table[fd].off += ret;
-  else
-    fd_table[fd_indirection[fd]].off += ret;
+  unlock_map(fd);
 
   return ret;
 }
@@ -760,39 +1211,33 @@ ssize_t nvreadv(int fd, const struct iovec *iov, int iovcnt) {
  */
 ssize_t nvwritev(int fd, const struct iovec *iov, int iovcnt) {
   int i;
-  ssize_t ret = 0, file_size = fd_table[fd_indirection[fd]].current_file_size,
-          len;
-  void *dst = get_fd_addr_cur(fd);
-  if (dst == NULL) {
+  ssize_t ret = 0;
+  size_t cnt = 0;
+  off_t off;
+  if (file_entry(fd)->addr == NULL) {
     return writev(fd, iov, iovcnt);
   }
 
-  if (fd_table[fd].dupfd == fd)
-    len = fd_table[fd].off;
-  else
-    len = fd_table[fd_indirection[fd]].off;
-
   for (i = 0; i < iovcnt; i++) {
-    ssize_t iovlen = iov[i].iov_len;
-    len += iovlen;
-    if (len > file_size) {
-      expand_remap_fd(fd, file_size);
-    }
-    ret += pwriteToMap(fd, iov[i].iov_base, iovlen, dst);
-    dst += iovlen;
+    cnt += iov[i].iov_len;
   }
 
-  if (fd_table[fd].dupfd == fd) {
-    fd_table[fd].off += ret;
-    if (fd_table[fd].off > file_size)
-      fd_table[fd_indirection[fd]].written_file_size = fd_table[fd].off;
-  } else {
-    fd_table[fd_indirection[fd]].off += ret;
-    if (fd_table[fd_indirection[fd]].off > file_size)
-      fd_table[fd_indirection[fd]].written_file_size =
-          fd_table[fd_indirection[fd]].off;
+  read_lock_map(fd);
+  if (fd_entry(fd)->append) {
+    off = appendToMap(fd, iov, iovcnt, cnt);
+    unlock_map(fd);
+    __atomic_store_n(&off_entry(fd)->off, off + cnt, __ATOMIC_RELAXED);
+    return cnt;
+  }
+  off = advance_fd_off(fd, cnt);
+
+  for (i = 0; i < iovcnt; i++) {
+    ret += pwriteToMap(fd, iov[i].iov_base, iov[i].iov_len,
+                       get_fd_addr_set(fd, off + ret));
   }
 
+  update_written_size(fd, off + ret);
+  unlock_map(fd);
   return ret;
 }
 
@@ -824,16 +1269,16 @@ int nvfcntl(int fd, int cmd, ...) {
       va_start(arg, cmd);
       f1 = va_arg(arg, struct flock *);
       va_end(arg);
-      return fcntl(fd_indirection[fd], cmd, f1);
+      return fcntl(fd_entry(fd)->indirection, cmd, f1);
     case F_SETFD:
       va_start(arg, cmd);
       flags = va_arg(arg, int);
       va_end(arg);
       sanitize_flags(&flags);
-      return fcntl(fd_indirection[fd], cmd, flags);
+      return fcntl(fd_entry(fd)->indirection, cmd, flags);
     case F_GETFD:
       // return fd flags
-      return fcntl(fd_indirection[fd], cmd);
+      return fcntl(fd_entry(fd)->indirection, cmd);
     default:
       // printf("[%s]: the cmd:%d is not defined in %s\n", __func__, cmd,
       // __func__);
@@ -848,7 +1293,7 @@ int nvfcntl(int fd, int cmd, ...) {
 int nvstat(const char *pathname, struct stat *statbuf) {
   int ret = stat(pathname, statbuf);
   int fd = get_path_fd(pathname);
-  statbuf->st_size = fd_table[fd_indirection[fd]].written_file_size;
+  statbuf->st_size = file_entry(fd)->written_file_size;
   return ret;
 }
 
@@ -864,18 +1309,18 @@ int nvunlink(const char *pathname) {
 int nvrename(const char *oldpath, const char *newpath) {
   int fd = get_path_fd(oldpath);
   if (fd > 0) {
-    memcpy(fd_table[fd_indirection[fd]].pathname, newpath, strlen(newpath));
+    memcpy(file_entry(fd)->pathname, newpath, strlen(newpath));
   }
   return rename(oldpath, newpath);
 }
 
 int nvposix_fadvise(int fd, off_t offset, off_t len, int advice) {
-  return posix_fadvise(fd_indirection[fd], offset, len, advice);
+  return posix_fadvise(fd_entry(fd)->indirection, offset, len, advice);
 }
 
 int nvfstat(int fd, struct stat *statbuf) {
   int ret = fstat(fd, statbuf);
-  statbuf->st_size = fd_table[fd_indirection[fd]].written_file_size;
+  statbuf->st_size = file_entry(fd)->written_file_size;
   return ret;
 }
 
@@ -884,8 +1329,8 @@ int nvfstat(int fd, struct stat *statbuf) {
  */
 int nvsync_file_range(int fd, off64_t offset, off64_t nbytes) {
   trunc_fit_fd(fd);
-  LIBNVMMIO_DEBUG("addr:%ld, len:%ld", (long int)fd_table[fd].addr, fd_table[fd].written_file_size);
-  return nvmsync(fd_table[fd_indirection[fd]].addr + offset, nbytes, MS_ASYNC);
+  LIBNVMMIO_DEBUG("addr:%ld, len:%ld", (long int)fd_entry(fd)->addr, fd_entry(fd)->written_file_size);
+  return nvmsync(file_entry(fd)->addr + offset, nbytes, MS_ASYNC);
 }
 
 /**
@@ -894,7 +1339,7 @@ int nvsync_file_range(int fd, off64_t offset, off64_t nbytes) {
 int nvfallocate(int fd, int mode, off_t offset, off_t len) {
   // TODO: zero out unwritten area to end of file
   off_t required_len = offset + len;
-  size_t current_file_size = fd_table[fd_indirection[fd]].current_file_size;
+  size_t current_file_size = file_entry(fd)->current_file_size;
   LIBNVMMIO_DEBUG("");
 
   if (current_file_size < (size_t)required_len) {
@@ -902,7 +1347,7 @@ int nvfallocate(int fd, int mode, off_t offset, off_t len) {
     if (ret < 0)
       return ret;
     else {
-      fd_table[fd_indirection[fd]].current_file_size = required_len;
+      file_entry(fd)->current_file_size = required_len;
     }
     return ret;
   } else {
@@ -3,4 +3,47 @@
 
 #define O_ATOMIC 01000000000
 
+/**
+ * @brief nvpread_zc()返回的lease，释放之前span指向的log数据不会被回收，
+ * 文件也不会被重新映射或解除映射
+ */
+typedef struct nvlease_struct {
+  void *uma;
+  void *map_lock; // 持有读锁的文件映射锁
+} nvlease_t;
+
+/**
+ * @brief nvfsync_async()的完成回调，一般在同步线程中调用；
+ * 调用时已经全部写回的，在nvfsync_async()返回之前由调用者的线程调用
+ */
+typedef void (*nvfsync_cb_t)(int fd, void *cookie);
+
+/* nvpolicy_params_t.mode，UNDO/REDO的取值与log entry中的policy相同 */
+#define NVPOLICY_UNDO (0)
+#define NVPOLICY_REDO (1)
+#define NVPOLICY_AUTO (2)
+
+/**
+ * @brief hybrid logging代价模型的参数
+ * 代价以字节为单位，读取log多花的时间按ns_cost折算
+ */
+typedef struct nvpolicy_params_struct {
+  int mode;                 /* NVPOLICY_AUTO按代价模型选择，否则固定使用该策略 */
+  unsigned int read_cost;   /* 从PMEM读取1字节的代价 */
+  unsigned int write_cost;  /* 向PMEM写入1字节的代价 */
+  unsigned int ns_cost;     /* 读取时检查log多花1ns的代价 */
+  unsigned int hysteresis;  /* 另一个策略的代价至少低这个百分比时才切换 */
+  unsigned long min_bytes;  /* 读写的字节数少于该值时保持当前策略 */
+} nvpolicy_params_t;
+
+/**
+ * @brief 一个2MB table在检查点之间的访问统计，代价模型的输入
+ */
+typedef struct nvpolicy_stats_struct {
+  unsigned long read_bytes;
+  unsigned long write_bytes;
+  unsigned long overwrite_bytes; /* 覆盖同一epoch内已在log中的数据的字节数 */
+  unsigned long log_read_ns;     /* REDO时读取因检查log多花的时间 */
+} nvpolicy_stats_t;
+
 #endif /* _LIBNVMMIO_NVRW_H */
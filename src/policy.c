@@ -0,0 +1,256 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "policy.h"
+#include "debug.h"
+
+/**
+ * @brief hybrid logging的代价模型
+ *
+ * 每个2MB table统计读写的字节数、同一epoch内被覆盖的字节数，以及REDO时
+ * 读取检查log多花的时间。检查点时按下面的PMEM流量估计两种策略的代价，
+ * 两种策略读取的字节数相同，只比较不同的部分：
+ *
+ *   UNDO: 写入时先读出旧数据写入log，再就地写；读取直接访问映射文件
+ *         W * (read + 2 * write)
+ *   REDO: 写入log；检查点时每个最终的字节读出log写回一次，覆盖的部分只写回一次；
+ *         读取需要检查log
+ *         W * write + (W - O) * (read + write) + ns * ns_cost
+ *
+ * 另一个策略的代价低于当前策略hysteresis%以上才切换，避免来回切换。
+ * 参数可以通过NVMMIO_POLICY或nvpolicy_set_params()调整，
+ * nvpolicy_choose()使用同一个模型，便于用trace离线验证。
+ */
+static nvpolicy_params_t policy_params = {
+    .mode = NVPOLICY_AUTO,
+    .read_cost = DEFAULT_POLICY_READ_COST,
+    .write_cost = DEFAULT_POLICY_WRITE_COST,
+    .ns_cost = DEFAULT_POLICY_NS_COST,
+    .hysteresis = DEFAULT_POLICY_HYSTERESIS,
+    .min_bytes = DEFAULT_POLICY_MIN_BYTES,
+};
+
+/* 直接从映射文件读取，以及读取时检查log多花的时间，单位ps/byte */
+static unsigned long direct_read_ps = DEFAULT_POLICY_DIRECT_READ_PS;
+static unsigned long log_read_ps = 0;
+
+static __thread unsigned int nr_sampled_reads = 0;
+
+static bool valid_policy_params(const nvpolicy_params_t *params) {
+  if (params->mode < NVPOLICY_UNDO || params->mode > NVPOLICY_AUTO) {
+    return false;
+  }
+  return params->hysteresis < 100;
+}
+
+/**
+ * @brief 解析NVMMIO_POLICY，如"mode=auto,write=3,hysteresis=20"，
+ * 不认识的项被忽略
+ */
+static void parse_policy_env(const char *str, nvpolicy_params_t *params) {
+  char *buf, *token, *saveptr, *value;
+
+  buf = strdup(str);
+  if (__glibc_unlikely(buf == NULL)) {
+    handle_error("strdup");
+  }
+
+  for (token = strtok_r(buf, ",", &saveptr); token != NULL;
+       token = strtok_r(NULL, ",", &saveptr)) {
+    value = strchr(token, '=');
+    if (value == NULL) continue;
+    *value++ = '\0';
+
+    if (strcmp(token, "mode") == 0) {
+      if (strcmp(value, "undo") == 0)
+        params->mode = NVPOLICY_UNDO;
+      else if (strcmp(value, "redo") == 0)
+        params->mode = NVPOLICY_REDO;
+      else if (strcmp(value, "auto") == 0)
+        params->mode = NVPOLICY_AUTO;
+    } else if (strcmp(token, "read") == 0) {
+      params->read_cost = strtoul(value, NULL, 0);
+    } else if (strcmp(token, "write") == 0) {
+      params->write_cost = strtoul(value, NULL, 0);
+    } else if (strcmp(token, "ns") == 0) {
+      params->ns_cost = strtoul(value, NULL, 0);
+    } else if (strcmp(token, "hysteresis") == 0) {
+      params->hysteresis = strtoul(value, NULL, 0);
+    } else if (strcmp(token, "min_bytes") == 0) {
+      params->min_bytes = strtoul(value, NULL, 0);
+    }
+  }
+
+  free(buf);
+}
+
+void init_policy(void) {
+  nvpolicy_params_t params = policy_params;
+  char *env;
+
+  env = getenv(POLICY_ENV);
+  if (env == NULL) return;
+
+  parse_policy_env(env, &params);
+  if (nvpolicy_set_params(&params) != 0) {
+    LIBNVMMIO_DEBUG("invalid %s: %s", POLICY_ENV, env);
+  }
+}
+
+/**
+ * @brief 参数的各个字段独立读取，与nvpolicy_set_params()并发时
+ * 一次决策可能混用新旧参数，只影响该次决策
+ */
+void nvpolicy_get_params(nvpolicy_params_t *params) {
+  params->mode = __atomic_load_n(&policy_params.mode, __ATOMIC_RELAXED);
+  params->read_cost =
+      __atomic_load_n(&policy_params.read_cost, __ATOMIC_RELAXED);
+  params->write_cost =
+      __atomic_load_n(&policy_params.write_cost, __ATOMIC_RELAXED);
+  params->ns_cost = __atomic_load_n(&policy_params.ns_cost, __ATOMIC_RELAXED);
+  params->hysteresis =
+      __atomic_load_n(&policy_params.hysteresis, __ATOMIC_RELAXED);
+  params->min_bytes =
+      __atomic_load_n(&policy_params.min_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 设置代价模型的参数，已有的table在下一个检查点按新参数切换
+ */
+int nvpolicy_set_params(const nvpolicy_params_t *params) {
+  if (params == NULL || !valid_policy_params(params)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  __atomic_store_n(&policy_params.read_cost, params->read_cost,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&policy_params.write_cost, params->write_cost,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&policy_params.ns_cost, params->ns_cost, __ATOMIC_RELAXED);
+  __atomic_store_n(&policy_params.hysteresis, params->hysteresis,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&policy_params.min_bytes, params->min_bytes,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&policy_params.mode, params->mode, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static int choose_policy(const nvpolicy_params_t *params,
+                         const nvpolicy_stats_t *stats, int current) {
+  unsigned long writes, unique, undo, redo;
+
+  if (params->mode != NVPOLICY_AUTO) {
+    return params->mode;
+  }
+
+  writes = stats->write_bytes;
+  if (stats->read_bytes + writes < params->min_bytes) {
+    return current;
+  }
+  unique = writes - (stats->overwrite_bytes < writes ? stats->overwrite_bytes
+                                                     : writes);
+
+  undo = writes * (params->read_cost + 2UL * params->write_cost);
+  redo = writes * params->write_cost +
+         unique * (params->read_cost + params->write_cost) +
+         stats->log_read_ns * params->ns_cost;
+
+  if (current == NVPOLICY_UNDO) {
+    if (redo * 100 < undo * (100 - params->hysteresis)) {
+      return NVPOLICY_REDO;
+    }
+  } else {
+    if (undo * 100 < redo * (100 - params->hysteresis)) {
+      return NVPOLICY_UNDO;
+    }
+  }
+  return current;
+}
+
+/**
+ * @brief 按当前参数返回代价模型为stats选择的策略
+ *
+ * @param current 当前的策略，NVPOLICY_UNDO或NVPOLICY_REDO
+ * @return 参数无效时返回-1
+ */
+int nvpolicy_choose(const nvpolicy_stats_t *stats, int current) {
+  nvpolicy_params_t params;
+
+  if (stats == NULL ||
+      (current != NVPOLICY_UNDO && current != NVPOLICY_REDO)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  nvpolicy_get_params(&params);
+  return choose_policy(&params, stats, current);
+}
+
+/**
+ * @brief 新建table的策略，固定策略时使用该策略
+ */
+log_policy_t default_table_policy(void) {
+  int mode = __atomic_load_n(&policy_params.mode, __ATOMIC_RELAXED);
+
+  if (mode == NVPOLICY_AUTO) {
+    return DEFAULT_POLICY;
+  }
+  return (log_policy_t)mode;
+}
+
+unsigned long get_policy_min_bytes(void) {
+  return __atomic_load_n(&policy_params.min_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 本线程的这次读取是否测量耗时，测量结果按采样率放大
+ */
+bool sample_read_time(void) {
+  return (++nr_sampled_reads % POLICY_SAMPLE_READS) == 0;
+}
+
+static void update_read_ps(unsigned long *ps, unsigned long sample) {
+  unsigned long old = __atomic_load_n(ps, __ATOMIC_RELAXED);
+
+  if (old == 0) {
+    __atomic_store_n(ps, sample, __ATOMIC_RELAXED);
+    return;
+  }
+  /* 不要求精确，并发时丢失一次更新没有影响 */
+  __atomic_store_n(ps, old - (old >> POLICY_EWMA_SHIFT) +
+                           (sample >> POLICY_EWMA_SHIFT),
+                   __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 记录一次直接从映射文件读取的耗时，作为检查log的开销的基准
+ */
+void account_direct_read_time(unsigned long len, unsigned long ns) {
+  if (len < POLICY_SAMPLE_MIN_BYTES) return;
+
+  update_read_ps(&direct_read_ps, ns * 1000 / len);
+}
+
+/**
+ * @brief 记录一次检查log的读取的耗时，返回比直接读取多花的时间
+ */
+unsigned long account_log_read_time(unsigned long len, unsigned long ns) {
+  unsigned long direct, overhead;
+
+  direct = __atomic_load_n(&direct_read_ps, __ATOMIC_RELAXED) * len / 1000;
+  overhead = ns > direct ? ns - direct : 0;
+
+  update_read_ps(&log_read_ps, overhead * 1000 / len);
+  return overhead;
+}
+
+/**
+ * @brief 估计UNDO table改为REDO后读取len字节多花的时间
+ */
+unsigned long estimate_log_read_ns(unsigned long len) {
+  return __atomic_load_n(&log_read_ps, __ATOMIC_RELAXED) * len / 1000;
+}
@@ -0,0 +1,41 @@
+#ifndef _LIBNVMMIO_POLICY_H
+#define _LIBNVMMIO_POLICY_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "nvrw.h"
+#include "uma.h"
+
+#define POLICY_ENV "NVMMIO_POLICY"
+
+#define DEFAULT_POLICY_READ_COST (1)  /* 从PMEM读取1字节的代价 */
+#define DEFAULT_POLICY_WRITE_COST (3) /* PMEM的写带宽约为读带宽的1/3 */
+#define DEFAULT_POLICY_NS_COST (4)    /* 1ns约相当于从PMEM读取4字节 */
+#define DEFAULT_POLICY_HYSTERESIS (20)
+#define DEFAULT_POLICY_MIN_BYTES (1UL << 16)
+#define DEFAULT_POLICY_DIRECT_READ_PS (170) /* 约6GB/s，测得第一个样本之前使用 */
+
+#define POLICY_SAMPLE_READS (16)       /* 每隔多少次读取测量一次耗时 */
+#define POLICY_SAMPLE_MIN_BYTES (4096) /* 更小的直接读取不用于估计带宽 */
+#define POLICY_EWMA_SHIFT (3)          /* 测量值的权重为1/8 */
+
+void nvpolicy_get_params(nvpolicy_params_t *params);
+int nvpolicy_set_params(const nvpolicy_params_t *params);
+int nvpolicy_choose(const nvpolicy_stats_t *stats, int current);
+void init_policy(void);
+log_policy_t default_table_policy(void);
+unsigned long get_policy_min_bytes(void);
+bool sample_read_time(void);
+void account_direct_read_time(unsigned long len, unsigned long ns);
+unsigned long account_log_read_time(unsigned long len, unsigned long ns);
+unsigned long estimate_log_read_ns(unsigned long len);
+
+static inline unsigned long policy_clock_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#endif /* _LIBNVMMIO_POLICY_H */
@@ -42,7 +42,7 @@ inline int atomic_increase(int *count) {
  */
  // CONFUSE：这里跟论文不一样的是好像没有对不同Size的Log Entry区分处理
  // SOLVE： 并不直接对size判断，而是通过对最后21位的移位来进行控制
-log_table_t *get_log_table(unsigned long address) {
+log_table_t *get_log_table(unsigned long address, log_size_t log_size) {
   log_table_t *lud, *lmd, *table;
   unsigned long index;
 
@@ -78,6 +78,8 @@ log_table_t *get_log_table(unsigned long address) {
 
   if (table == NULL) {
     table = alloc_log_table(lmd, index, TABLE);
+    /* 新table的log_size在发布前确定，之后只在检查点调整 */
+    table->log_size = log_size;
 
     if (!__sync_bool_compare_and_swap(&lmd->entries[index], NULL, table)) {
       // free(table);
@@ -110,13 +112,14 @@ log_table_t *__get_next_table(log_table_t *table, unsigned long *nrpages) {
   return NULL;
 }
 
-log_table_t *get_next_table2(log_table_t *table, table_type_t type) {
+log_table_t *get_next_table2(log_table_t *table, table_type_t type,
+                             log_size_t log_size) {
   log_table_t *next_table;
   log_table_t *parent = table->parent;
   unsigned long index = table->index + 1;
 
   if (index == PTRS_PER_TABLE) {
-    parent = get_next_table2(parent, type * PTRS_PER_TABLE);
+    parent = get_next_table2(parent, type * PTRS_PER_TABLE, log_size);
     index = 0;
   }
 
@@ -124,6 +127,7 @@ log_table_t *get_next_table2(log_table_t *table, table_type_t type) {
 
   if (next_table == NULL) {
     next_table = alloc_log_table(parent, index, type);
+    next_table->log_size = log_size;
 
     if (!__sync_bool_compare_and_swap(&parent->entries[index], NULL,
                                       next_table)) {
@@ -194,18 +198,21 @@ log_entry_t *get_log_entry(unsigned long address, uma_t *uma) {
   log_entry_t *entry;
   unsigned long index;
 
-  table = get_log_table(address);
+  table = get_log_table(address, LOG_4K);
   index = table_index(table->log_size, address);
 
   entry = table->entries[index];
 
   if (entry == NULL) {
-    entry = alloc_log_entry(uma, table->log_size);
+    entry = alloc_log_entry(uma, table->log_size, table->policy);
 
     if (__sync_bool_compare_and_swap(&table->entries[index], NULL, entry)) {
       atomic_increase(&table->count);
+      set_table_entry_valid(table, index);
+      mark_uma_table_dirty(uma, address);
     } else {
-      free_log_entry(entry, table->log_size, false);
+      lock_log_entry(entry);
+      free_log_entry(entry, false);
       entry = table->entries[index];
     }
   }
@@ -213,6 +220,59 @@ log_entry_t *get_log_entry(unsigned long address, uma_t *uma) {
   return entry;
 }
 
+/**
+ * @brief 返回最近写入字节数最多的大小，并让直方图衰减一半，以便跟上写入模式的变化
+ * 写入的字节数不足时保持当前的log_size
+ */
+log_size_t preferred_log_size(log_table_t *table) {
+  unsigned long total = 0, max = 0, bytes;
+  log_size_t log_size = table->log_size;
+  int i;
+
+  for (i = 0; i < (int)NR_TABLE_LOG_SIZES; i++) {
+    total += table->hist[i];
+  }
+  if (total < TABLE_HIST_MIN_BYTES) {
+    return log_size;
+  }
+
+  for (i = 0; i < (int)NR_TABLE_LOG_SIZES; i++) {
+    bytes = __atomic_load_n(&table->hist[i], __ATOMIC_RELAXED);
+    if (bytes > max) {
+      max = bytes;
+      log_size = (log_size_t)i;
+    }
+    __atomic_store_n(&table->hist[i], bytes >> 1, __ATOMIC_RELAXED);
+  }
+  return log_size;
+}
+
+static inline void decay_table_stat(unsigned long *stat,
+                                    unsigned long value) {
+  __atomic_store_n(stat, value >> 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 按代价模型返回table应使用的log策略，并让统计衰减一半
+ * 读写的字节数不足时不衰减，继续累积到下一个检查点
+ */
+log_policy_t preferred_table_policy(log_table_t *table) {
+  nvpolicy_stats_t stats = table->stats;
+
+  if (stats.read_bytes + stats.write_bytes >= get_policy_min_bytes()) {
+    decay_table_stat(&table->stats.read_bytes, stats.read_bytes);
+    decay_table_stat(&table->stats.write_bytes, stats.write_bytes);
+    decay_table_stat(&table->stats.overwrite_bytes, stats.overwrite_bytes);
+    decay_table_stat(&table->stats.log_read_ns, stats.log_read_ns);
+  }
+
+  /* UNDO table的读取不检查log，按其它table测得的开销估计 */
+  if (table->policy == UNDO) {
+    stats.log_read_ns = estimate_log_read_ns(stats.read_bytes);
+  }
+  return (log_policy_t)nvpolicy_choose(&stats, table->policy);
+}
+
 void init_radixlog(void) {
   if (lgd == NULL) {
     lgd = alloc_log_table(NULL, 0, LGD);
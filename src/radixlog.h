@@ -1,27 +1,112 @@
 #ifndef _LIBNVMMIO_RADIXLOG_H
 #define _LIBNVMMIO_RADIXLOG_H
 
+#include <sched.h>
+#include <stdbool.h>
+
 #include "allocator.h"
 #include "internal.h"
+#include "policy.h"
 #include "uma.h"
 
-typedef struct log_entry_struct {
+#define LOG_RECORD_EPOCH_BITS (20) /* 只保存epoch的低位，见log_epoch() */
+#define LOG_RECORD_UMA_BITS (10)   /* MAX_NR_UMAS */
+#define LOG_RECORD_BLOCK_BITS (22)
+#define LOG_RECORD_PAGE_BITS (27)  /* 单个映射最大512GB */
+
+/**
+ * @brief 持久化在entries.log中的log entry，16字节，4个record共享一个cache line
+ * 只保存偏移而不保存虚拟地址，崩溃后重新映射到任意地址都能恢复
+ */
+typedef struct log_record_struct {
   union {
     struct {
       unsigned long united;
     };
     struct {
-      unsigned long epoch : 20; // 版本号
+      unsigned long epoch : LOG_RECORD_EPOCH_BITS; // 版本号的低位
       unsigned long offset : 21; // 有效数据在log_entry中的偏移
       unsigned long len : 22; // 有效数据的长度
       unsigned long policy : 1; 
     };
   };
+  union {
+    struct {
+      unsigned long location;
+    };
+    struct {
+      unsigned long uma : LOG_RECORD_UMA_BITS; // uma在umas.log中的下标
+      unsigned long log_size : 4;
+      unsigned long block : LOG_RECORD_BLOCK_BITS; // data块在data log中的下标
+      unsigned long page : LOG_RECORD_PAGE_BITS; // dst相对于uma->start的页号
+      unsigned long valid : 1;
+    };
+  };
+} log_record_t;
+
+/**
+ * @brief log entry在DRAM中的shadow
+ * 前16字节与log_record_t相同，修改后通过store_log_record()写回record再flush
+ */
+typedef struct log_entry_struct {
+  union {
+    struct {
+      unsigned long united;
+    };
+    struct {
+      unsigned long epoch : LOG_RECORD_EPOCH_BITS;
+      unsigned long offset : 21;
+      unsigned long len : 22;
+      unsigned long policy : 1; 
+    };
+  };
+  union {
+    struct {
+      unsigned long location;
+    };
+    struct {
+      unsigned long uma : LOG_RECORD_UMA_BITS;
+      unsigned long log_size : 4;
+      unsigned long block : LOG_RECORD_BLOCK_BITS;
+      unsigned long page : LOG_RECORD_PAGE_BITS;
+      unsigned long valid : 1;
+    };
+  };
   void *data; // 指向log entry
   void *dst;  // 与offset一起指向写回到映射文件的地址
-  pthread_rwlock_t *rwlockp;
+  log_record_t *record; // 持久化的部分
+  unsigned long version; // 版本锁，奇数表示写者持有
 } log_entry_t;
 
+#define LOG_LOCK_MIN_BACKOFF (1)    /* 退避的初始pause次数 */
+#define LOG_LOCK_MAX_BACKOFF (1024) /* 超过后改为让出CPU */
+#define TABLE_HIST_MIN_BYTES (1UL << 16) /* 写入的字节数少于该值时不调整table的log_size */
+#define TABLE_VALID_WORDS (PTRS_PER_TABLE / BITS_PER_LONG)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define LOG_EPOCH_MASK ((1UL << LOG_RECORD_EPOCH_BITS) - 1)
+#define LOG_EPOCH_HALF (1UL << (LOG_RECORD_EPOCH_BITS - 1))
+
+/**
+ * @brief 由record中epoch的低位还原完整的epoch，取与current最接近的值
+ * 还留在log中的entry的epoch与uma的epoch相差不超过LOG_EPOCH_HALF，
+ * 已提交的entry在此之前早已被检查点写回并释放
+ */
+static inline unsigned long log_epoch(unsigned long epoch,
+                                      unsigned long current) {
+  unsigned long delta = (epoch - current) & LOG_EPOCH_MASK;
+
+  if (delta & LOG_EPOCH_HALF) {
+    delta -= LOG_EPOCH_MASK + 1;
+  }
+  return current + delta;
+}
+
 /**
  * @brief radix tree的内部节点
  * 
@@ -29,6 +114,10 @@ typedef struct log_entry_struct {
  * @param log_size z指向的log entry的大小
  * @param index 在当前桶阵列的index
  * @param entries 指向的log entries
+ * @param hist 按字节数加权的写入大小直方图，检查点时据此调整log_size
+ * @param valid 有entry的index的位图，与count一起更新，读取时据此跳过没有log的部分
+ * @param policy table内log entry的策略，只在table中没有entry时切换
+ * @param stats 读写统计，检查点时由代价模型据此决定policy
  * 
  */
 typedef struct log_table_struct {
@@ -38,19 +127,196 @@ typedef struct log_table_struct {
   struct log_table_struct *parent;
   int index;
   void *entries[PTRS_PER_TABLE];
+  unsigned long hist[NR_TABLE_LOG_SIZES];
+  unsigned long valid[TABLE_VALID_WORDS];
+  log_policy_t policy;
+  nvpolicy_stats_t stats;
 } log_table_t;
 
+/**
+ * @brief 记录一次写入table的大小，不要求精确
+ * 直方图按字节数计，大量小写中夹杂的大写入仍能决定log_size
+ */
+static inline void account_table_write(log_table_t *table,
+                                       log_size_t log_size,
+                                       unsigned long len) {
+  __atomic_fetch_add(&table->hist[log_size], len, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&table->stats.write_bytes, len, __ATOMIC_RELAXED);
+}
+
+static inline void account_table_overwrite(log_table_t *table,
+                                           unsigned long len) {
+  __atomic_fetch_add(&table->stats.overwrite_bytes, len, __ATOMIC_RELAXED);
+}
+
+static inline void account_table_read(log_table_t *table, unsigned long len) {
+  __atomic_fetch_add(&table->stats.read_bytes, len, __ATOMIC_RELAXED);
+}
+
+static inline void account_table_log_read(log_table_t *table,
+                                          unsigned long ns) {
+  __atomic_fetch_add(&table->stats.log_read_ns, ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 读取时是否需要检查table中的log
+ * UNDO table的最新数据就在映射文件中，读者可以直接拷贝
+ */
+static inline bool table_has_redo_log(log_table_t *table) {
+  return table != NULL &&
+         __atomic_load_n(&table->policy, __ATOMIC_ACQUIRE) == REDO &&
+         table->count > 0;
+}
+
+static inline void set_table_entry_valid(log_table_t *table,
+                                         unsigned long index) {
+  __atomic_fetch_or(&table->valid[index / BITS_PER_LONG],
+                    1UL << (index % BITS_PER_LONG), __ATOMIC_RELEASE);
+}
+
+static inline void clear_table_entry_valid(log_table_t *table,
+                                           unsigned long index) {
+  __atomic_fetch_and(&table->valid[index / BITS_PER_LONG],
+                     ~(1UL << (index % BITS_PER_LONG)), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 返回从index开始（含）第一个有entry的index，没有时返回end
+ */
+static inline unsigned long next_table_entry_valid(log_table_t *table,
+                                                   unsigned long index,
+                                                   unsigned long end) {
+  unsigned long word, bits;
+
+  while (index < end) {
+    word = index / BITS_PER_LONG;
+    bits = __atomic_load_n(&table->valid[word], __ATOMIC_ACQUIRE);
+    bits &= ~0UL << (index % BITS_PER_LONG);
+
+    if (bits) {
+      index = word * BITS_PER_LONG + __builtin_ctzl(bits);
+      return index < end ? index : end;
+    }
+    index = (word + 1) * BITS_PER_LONG;
+  }
+  return end;
+}
+
+/**
+ * @brief 把shadow中的header复制到持久化的record，返回值用于flush
+ */
+static inline log_record_t *store_log_record(log_entry_t *entry) {
+  entry->record->location = entry->location;
+  entry->record->united = entry->united;
+  return entry->record;
+}
+
+/**
+ * @brief 返回data块对应的页内偏移0的位置，加上页内偏移即为数据在data块中的地址
+ * offset可以是window内的任意偏移
+ */
+static inline void *log_data_base(void *data, unsigned long log_size,
+                                  unsigned long offset) {
+  return data - DATA_WINDOW(log_size, offset);
+}
+
+/**
+ * @brief 返回entry中有效数据的起始地址
+ */
+static inline void *log_entry_start(log_entry_t *entry) {
+  return log_data_base(entry->data, entry->log_size, entry->offset) +
+         entry->offset;
+}
+
+/**
+ * @brief 设置写回地址，同时记录dst相对于uma->start的页号
+ */
+static inline void set_log_entry_dst(log_entry_t *entry,
+                                     struct mmap_area_struct *uma, void *dst) {
+  entry->dst = dst;
+  entry->page = (unsigned long)(dst - uma->start) >> PAGE_SHIFT;
+}
+
+/**
+ * @brief 有界指数退避，等待次数达到上限后让出CPU
+ */
+static inline void log_lock_backoff(unsigned int *backoff) {
+  unsigned int i;
+
+  if (*backoff == 0) {
+    *backoff = LOG_LOCK_MIN_BACKOFF;
+  }
+
+  if (*backoff > LOG_LOCK_MAX_BACKOFF) {
+    sched_yield();
+    return;
+  }
+
+  for (i = 0; i < *backoff; i++) {
+    cpu_relax();
+  }
+  *backoff <<= 1;
+}
+
+/**
+ * @brief 写者获取entry的版本锁，失败时不等待
+ */
+static inline bool try_lock_log_entry(log_entry_t *entry) {
+  unsigned long version = __atomic_load_n(&entry->version, __ATOMIC_RELAXED);
+
+  return !(version & 1) &&
+         __sync_bool_compare_and_swap(&entry->version, version, version + 1);
+}
+
+static inline void lock_log_entry(log_entry_t *entry) {
+  unsigned int backoff = 0;
+
+  while (!try_lock_log_entry(entry)) {
+    log_lock_backoff(&backoff);
+  }
+}
+
+static inline void unlock_log_entry(log_entry_t *entry) {
+  __atomic_store_n(&entry->version, entry->version + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 乐观读开始，等待写者释放后返回当前版本
+ */
+static inline unsigned long read_begin_log_entry(log_entry_t *entry) {
+  unsigned int backoff = 0;
+  unsigned long version;
+
+  while ((version = __atomic_load_n(&entry->version, __ATOMIC_ACQUIRE)) & 1) {
+    log_lock_backoff(&backoff);
+  }
+  return version;
+}
+
+/**
+ * @brief 乐观读结束，版本发生变化时读到的数据无效，需要重读
+ */
+static inline bool read_retry_log_entry(log_entry_t *entry,
+                                        unsigned long version) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&entry->version, __ATOMIC_RELAXED) != version;
+}
+
 void init_radixlog(void);
 unsigned long table_index(log_size_t log_size, unsigned long address);
 struct log_entry_struct *find_log_entry(unsigned long address);
 struct log_table_struct *find_log_table(unsigned long address);
 struct log_entry_struct *get_log_entry(unsigned long address,
                                        struct mmap_area_struct *uma);
-struct log_table_struct *get_log_table(unsigned long address);
+struct log_table_struct *get_log_table(unsigned long address,
+                                       log_size_t log_size);
+log_size_t preferred_log_size(struct log_table_struct *table);
+log_policy_t preferred_table_policy(struct log_table_struct *table);
 struct log_table_struct *get_next_table(struct log_table_struct *table,
                                         unsigned long *nrpages);
 struct log_table_struct *get_next_table2(struct log_table_struct *table,
-                                         table_type_t type);
+                                         table_type_t type,
+                                         log_size_t log_size);
 int atomic_increase(int *count);
 
 #endif /* _LIBNVMMIO_RADIXLOG_H */
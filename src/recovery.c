@@ -0,0 +1,641 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "internal.h"
+#include "radixlog.h"
+#include "recovery.h"
+#include "uma.h"
+#include "debug.h"
+
+/* nodes.log中的根目录不超过LOG_ROOT_SIZE，指定精度避免编译器按整个数组估计长度 */
+#define NODE_DIR_PATH "%.*s/.libnvmmio-%lu"
+
+/**
+ * @brief 启动时恢复崩溃进程遗留的log目录
+ *
+ * 每个进程在存活期间持有自己log目录的flock，能拿到flock的.libnvmmio-<pid>
+ * 目录即为崩溃遗留的目录。恢复时读取其中持久化的uma和log record：
+ * 已提交(epoch < uma->epoch)的REDO entry写回映射文件，未提交的UNDO entry
+ * 把旧数据写回映射文件，其余entry直接丢弃。检查点写回table之后持久化的
+ * applied epoch记录在applied.log中，epoch不大于它的REDO entry已经在映射文件中，
+ * 不再写回。组提交的commit record有效时，其中各uma的epoch至少提高到记录的值。
+ * record只保存epoch的低位，先按修正后的uma epoch还原完整的epoch再比较。
+ * 之后删除整个目录回收空间。
+ *
+ * PMEM_PATH有多个路径时，每个路径下的同名目录保存一个log node的entries和
+ * data log，record中的块号指向同一目录下的data log；uma、applied和commit
+ * log只在第0个路径下。不同log node的record合并到同一个桶中排序。
+ * 各目录的nodes.log记录了进程使用的全部路径，恢复时按它而不是当前的
+ * PMEM_PATH查找各log node的目录。
+ *
+ * record按(映射文件, log size)分桶，多个线程并行处理不同的桶，
+ * 桶内按epoch排序，保证同一位置较新的record最后写回。
+ */
+typedef struct recovery_item_struct {
+  log_record_t *record;
+  unsigned long epoch; /* 还原后的完整epoch */
+  int node; /* record所在的log node */
+} recovery_item_t;
+
+typedef struct recovery_bucket_struct {
+  uma_t *uma;
+  int fd;
+  log_size_t log_size;
+  recovery_item_t *items;
+  unsigned long count;
+  unsigned long size;
+} recovery_bucket_t;
+
+typedef struct recovery_struct {
+  uma_t *umas;
+  int fds[MAX_NR_UMAS]; /* 重新打开的映射文件，下标与umas.log相同 */
+  unsigned long epochs[MAX_NR_UMAS]; /* 按commit record修正后的epoch */
+  char (*paths)[LOG_ROOT_SIZE]; /* 各log node的根目录，来自nodes.log */
+  int nr_nodes;
+  int data_fds[MAX_NR_LOG_NODES][NR_LOG_SIZES];
+  log_record_t *records[MAX_NR_LOG_NODES];
+  unsigned long nr_records[MAX_NR_LOG_NODES];
+  unsigned long *applied; /* 每个uma占UMA_MAX_TABLES项，没有该文件时为NULL */
+  unsigned long nr_applied;
+  recovery_bucket_t *buckets;
+  unsigned long nr_buckets;
+  unsigned long next; /* 下一个待处理的桶 */
+} recovery_t;
+
+static void *map_recovery_file(const char *path, size_t *len) {
+  struct stat sb;
+  void *addr;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  if (__glibc_unlikely(fstat(fd, &sb) != 0)) {
+    handle_error("fstat");
+  }
+
+  *len = sb.st_size;
+  if (*len == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  addr = mmap(0, *len, PROT_READ, MAP_SHARED, fd, 0);
+  if (__glibc_unlikely(addr == MAP_FAILED)) {
+    handle_error("mmap");
+  }
+  close(fd);
+  return addr;
+}
+
+static int compare_epoch(const void *a, const void *b) {
+  const recovery_item_t *x = (const recovery_item_t *)a;
+  const recovery_item_t *y = (const recovery_item_t *)b;
+
+  return (x->epoch > y->epoch) - (x->epoch < y->epoch);
+}
+
+/**
+ * @brief 读取umas.log，重新打开每个有效uma的映射文件和每个log node的data log
+ */
+static void load_umas(recovery_t *rec, const char *root, unsigned long pid) {
+  char filename[LOG_PATH_SIZE];
+  unsigned long i;
+  size_t len;
+  uma_t *uma;
+  int node;
+
+  for (i = 0; i < MAX_NR_UMAS; i++) {
+    rec->fds[i] = -1;
+  }
+
+  sprintf(filename, UMAS_PATH, root, pid);
+  rec->umas = (uma_t *)map_recovery_file(filename, &len);
+  if (rec->umas == NULL) {
+    return;
+  }
+
+  for (i = 0; i < len / sizeof(uma_t) && i < MAX_NR_UMAS; i++) {
+    uma = &rec->umas[i];
+    if (uma->path[0] == '\0' || uma->start == NULL || uma->end <= uma->start) {
+      continue;
+    }
+
+    rec->fds[i] = open(uma->path, O_RDWR);
+    if (rec->fds[i] == -1) {
+      LIBNVMMIO_DEBUG("cannot open %s, its logs are dropped", uma->path);
+    }
+  }
+
+  for (node = 0; node < rec->nr_nodes; node++) {
+    for (i = 0; i < NR_LOG_SIZES; i++) {
+      sprintf(filename, DATA_PATH, rec->paths[node], pid, (int)i);
+      rec->data_fds[node][i] = open(filename, O_RDONLY);
+    }
+  }
+}
+
+/**
+ * @brief 读取commit.log，有效的组提交把其中各uma的epoch提高到记录的值
+ * 崩溃时组提交可能只持久化了一部分uma的epoch
+ */
+static void load_commit_record(recovery_t *rec, const char *root,
+                               unsigned long pid) {
+  char filename[LOG_PATH_SIZE];
+  commit_record_t *record;
+  unsigned long i, index;
+  size_t len;
+
+  for (i = 0; i < MAX_NR_UMAS; i++) {
+    rec->epochs[i] = rec->fds[i] != -1 ? rec->umas[i].epoch : 0;
+  }
+
+  sprintf(filename, COMMIT_PATH, root, pid);
+  record = (commit_record_t *)map_recovery_file(filename, &len);
+  if (record == NULL) {
+    return;
+  }
+
+  if (len >= sizeof(commit_record_t) && rec->umas != NULL &&
+      record->csum == commit_record_csum(record)) {
+    for (i = 0; i < record->nr; i++) {
+      index = record->entries[i].uma;
+      if (index < MAX_NR_UMAS && rec->fds[index] != -1 &&
+          (unsigned long)rec->umas[index].id == record->entries[i].id &&
+          rec->epochs[index] < record->entries[i].epoch) {
+        rec->epochs[index] = record->entries[i].epoch;
+      }
+    }
+  }
+  munmap(record, len);
+}
+
+/**
+ * @brief record所在的table是否已在检查点中写回到该record的epoch
+ * applied.log中的table从对齐的uma->start起算，page相对于未对齐的start
+ *
+ * @param epoch 还原后的完整epoch，applied.log保存的是完整的epoch
+ */
+static bool is_record_applied(recovery_t *rec, log_record_t *record,
+                              unsigned long epoch) {
+  unsigned long i, start;
+
+  start = (unsigned long)rec->umas[record->uma].start;
+  i = record->uma * UMA_MAX_TABLES +
+      (((start & ~TABLE_MASK) + ((unsigned long)record->page << PAGE_SHIFT)) >>
+       TABLE_SHIFT);
+  return i < rec->nr_applied && epoch <= rec->applied[i];
+}
+
+static void add_record(recovery_bucket_t *bucket, log_record_t *record,
+                       unsigned long epoch, int node) {
+  if (bucket->count == bucket->size) {
+    bucket->size = bucket->size ? bucket->size * 2 : 64;
+    bucket->items = (recovery_item_t *)realloc(
+        bucket->items, bucket->size * sizeof(recovery_item_t));
+    if (__glibc_unlikely(bucket->items == NULL)) {
+      handle_error("realloc");
+    }
+  }
+  bucket->items[bucket->count].record = record;
+  bucket->items[bucket->count].epoch = epoch;
+  bucket->items[bucket->count].node = node;
+  bucket->count++;
+}
+
+/**
+ * @brief 扫描一个log node的entries.log，把需要处理的record按
+ * (映射文件, log size)分桶
+ */
+static void load_node_records(recovery_t *rec, int node, unsigned long pid) {
+  char filename[LOG_PATH_SIZE];
+  recovery_bucket_t *bucket;
+  log_record_t *record;
+  unsigned long i, window, end, epoch;
+  size_t len;
+  uma_t *uma;
+
+  sprintf(filename, ENTRIES_PATH, rec->paths[node], pid);
+  rec->records[node] = (log_record_t *)map_recovery_file(filename, &len);
+  if (rec->records[node] == NULL) {
+    return;
+  }
+  rec->nr_records[node] = len / sizeof(log_record_t);
+
+  for (i = 0; i < rec->nr_records[node]; i++) {
+    record = &rec->records[node][i];
+    if (!record->valid || record->len == 0 || record->log_size >= NR_LOG_SIZES ||
+        rec->fds[record->uma] == -1 ||
+        rec->data_fds[node][record->log_size] == -1) {
+      continue;
+    }
+    uma = &rec->umas[record->uma];
+    epoch = log_epoch(record->epoch, rec->epochs[record->uma]);
+
+    /* 只有已提交的REDO和未提交的UNDO需要写回 */
+    if ((epoch < rec->epochs[record->uma]) != (record->policy == REDO)) {
+      continue;
+    }
+    if (record->policy == REDO && is_record_applied(rec, record, epoch)) {
+      continue;
+    }
+
+    /* 小于一页的data块只保存页内的一段 */
+    window = DATA_WINDOW(record->log_size, (unsigned long)record->offset);
+    end = (unsigned long)record->offset + record->len;
+    if (end > window + DATA_SIZE(record->log_size) ||
+        ((unsigned long)record->page << PAGE_SHIFT) + end >
+            (unsigned long)(uma->end - uma->start)) {
+      LIBNVMMIO_DEBUG("invalid log record %lu on node %d", i, node);
+      continue;
+    }
+
+    bucket = &rec->buckets[record->uma * NR_LOG_SIZES + record->log_size];
+    bucket->uma = uma;
+    bucket->fd = rec->fds[record->uma];
+    bucket->log_size = record->log_size;
+    add_record(bucket, record, epoch, node);
+  }
+}
+
+static void load_records(recovery_t *rec, const char *root, unsigned long pid) {
+  char filename[LOG_PATH_SIZE];
+  size_t len;
+  int node;
+
+  if (rec->umas == NULL) {
+    return;
+  }
+
+  sprintf(filename, APPLIED_PATH, root, pid);
+  rec->applied = (unsigned long *)map_recovery_file(filename, &len);
+  if (rec->applied != NULL) {
+    rec->nr_applied = len / sizeof(unsigned long);
+  }
+
+  rec->nr_buckets = MAX_NR_UMAS * NR_LOG_SIZES;
+  rec->buckets =
+      (recovery_bucket_t *)calloc(rec->nr_buckets, sizeof(recovery_bucket_t));
+  if (__glibc_unlikely(rec->buckets == NULL)) {
+    handle_error("calloc");
+  }
+
+  for (node = 0; node < rec->nr_nodes; node++) {
+    load_node_records(rec, node, pid);
+  }
+}
+
+static void copy_log_data(int dst_fd, off_t dst_off, int src_fd, off_t src_off,
+                          size_t len, void *buf) {
+  ssize_t s;
+
+  s = pread(src_fd, buf, len, src_off);
+  if (__glibc_unlikely(s != (ssize_t)len)) {
+    handle_error("pread");
+  }
+
+  s = pwrite(dst_fd, buf, len, dst_off);
+  if (__glibc_unlikely(s != (ssize_t)len)) {
+    handle_error("pwrite");
+  }
+}
+
+static void *recovery_thread_func(void *arg) {
+  recovery_t *rec = (recovery_t *)arg;
+  recovery_bucket_t *bucket;
+  log_record_t *record;
+  unsigned long i, j;
+  off_t src_off, dst_off;
+  int node;
+  void *buf;
+
+  buf = malloc(LOG_SIZE(LOG_2M));
+  if (__glibc_unlikely(buf == NULL)) {
+    handle_error("malloc");
+  }
+
+  while ((i = __sync_fetch_and_add(&rec->next, 1)) < rec->nr_buckets) {
+    bucket = &rec->buckets[i];
+    if (bucket->count == 0) {
+      continue;
+    }
+
+    qsort(bucket->items, bucket->count, sizeof(recovery_item_t),
+          compare_epoch);
+
+    for (j = 0; j < bucket->count; j++) {
+      record = bucket->items[j].record;
+      node = bucket->items[j].node;
+      src_off = ((off_t)record->block << DATA_SHIFT(bucket->log_size)) +
+                record->offset -
+                DATA_WINDOW(bucket->log_size, (off_t)record->offset);
+      dst_off = bucket->uma->offset + ((off_t)record->page << PAGE_SHIFT) +
+                record->offset;
+
+      copy_log_data(bucket->fd, dst_off, rec->data_fds[node][bucket->log_size],
+                    src_off, record->len, buf);
+    }
+  }
+
+  free(buf);
+  return NULL;
+}
+
+static int get_nr_recovery_threads(recovery_t *rec) {
+  unsigned long nr_busy = 0, i;
+  char *env;
+  long nr;
+
+  for (i = 0; i < rec->nr_buckets; i++) {
+    if (rec->buckets[i].count > 0) {
+      nr_busy++;
+    }
+  }
+
+  env = getenv(RECOVERY_THREADS_ENV);
+  nr = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (nr > MAX_NR_RECOVERY_THREADS) {
+    nr = MAX_NR_RECOVERY_THREADS;
+  }
+  if (nr > (long)nr_busy) {
+    nr = nr_busy;
+  }
+  if (nr < 1) {
+    nr = 1;
+  }
+  return (int)nr;
+}
+
+static void cleanup_recovery(recovery_t *rec) {
+  unsigned long i, size;
+  int node;
+
+  for (i = 0; i < MAX_NR_UMAS; i++) {
+    if (rec->fds[i] != -1) {
+      /* 去掉文件末尾之后未提交的追加写 */
+      size = rec->umas[i].file_size[rec->epochs[i] & 1];
+      if (size != UMA_FILE_SIZE_UNKNOWN && rec->umas[i].offset == 0 &&
+          ftruncate(rec->fds[i], size) != 0) {
+        LIBNVMMIO_DEBUG("cannot truncate %s", rec->umas[i].path);
+      }
+      if (__glibc_unlikely(fdatasync(rec->fds[i]) != 0)) {
+        handle_error("fdatasync");
+      }
+      close(rec->fds[i]);
+    }
+  }
+
+  for (node = 0; node < rec->nr_nodes; node++) {
+    for (i = 0; i < NR_LOG_SIZES; i++) {
+      if (rec->data_fds[node][i] != -1) {
+        close(rec->data_fds[node][i]);
+      }
+    }
+
+    if (rec->records[node]) {
+      munmap(rec->records[node], rec->nr_records[node] * sizeof(log_record_t));
+    }
+  }
+
+  for (i = 0; i < rec->nr_buckets; i++) {
+    free(rec->buckets[i].items);
+  }
+  free(rec->buckets);
+
+  if (rec->umas) {
+    munmap(rec->umas, MAX_NR_UMAS * sizeof(uma_t));
+  }
+  if (rec->applied) {
+    munmap(rec->applied, rec->nr_applied * sizeof(unsigned long));
+  }
+}
+
+/**
+ * @brief 恢复一个崩溃进程遗留的log目录，返回后映射文件已经持久化
+ * @param paths 各log node的根目录，第0个保存元数据
+ */
+static void recover_log_dir(char (*paths)[LOG_ROOT_SIZE], int nr_nodes,
+                            unsigned long pid) {
+  pthread_t tid[MAX_NR_RECOVERY_THREADS];
+  recovery_t rec;
+  int i, nr_threads, s;
+
+  memset(&rec, 0, sizeof(recovery_t));
+  rec.paths = paths;
+  rec.nr_nodes = nr_nodes;
+  memset(rec.data_fds, -1, sizeof(rec.data_fds));
+
+  load_umas(&rec, paths[0], pid);
+  load_commit_record(&rec, paths[0], pid);
+  load_records(&rec, paths[0], pid);
+
+  if (rec.nr_buckets > 0) {
+    nr_threads = get_nr_recovery_threads(&rec);
+
+    for (i = 0; i < nr_threads; i++) {
+      s = pthread_create(&tid[i], NULL, recovery_thread_func, &rec);
+      if (__glibc_unlikely(s != 0)) {
+        handle_error_en(s, "pthread_create");
+      }
+    }
+
+    for (i = 0; i < nr_threads; i++) {
+      s = pthread_join(tid[i], NULL);
+      if (__glibc_unlikely(s != 0)) {
+        handle_error_en(s, "pthread_join");
+      }
+    }
+    LIBNVMMIO_DEBUG("pid=%lu, %d threads", pid, nr_threads);
+  }
+
+  cleanup_recovery(&rec);
+}
+
+/**
+ * @brief 打开并锁住log目录
+ * @return 目录不存在，或所属进程仍在运行、正在被其他进程恢复时返回-1
+ */
+static int lock_log_dir(const char *path) {
+  int fd;
+
+  fd = open(path, O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief 解析.libnvmmio-<pid>目录名，不是log目录或属于本进程时返回0
+ */
+static unsigned long get_log_dir_pid(const char *name) {
+  size_t prefix = strlen(LOG_DIR_PREFIX);
+  unsigned long pid;
+  char *end;
+
+  if (strncmp(name, LOG_DIR_PREFIX, prefix) != 0) {
+    return 0;
+  }
+
+  pid = strtoul(name + prefix, &end, 10);
+  if (end == name + prefix || *end != '\0' || pid == (unsigned long)getpid()) {
+    return 0;
+  }
+  return pid;
+}
+
+/**
+ * @brief 锁住并删除一个不需要恢复的log目录，被占用时跳过
+ */
+static void remove_log_dir(const char *path) {
+  int fd;
+
+  fd = lock_log_dir(path);
+  if (fd == -1) {
+    return;
+  }
+
+  rmlogs(path);
+  close(fd);
+  LIBNVMMIO_DEBUG("removed %s", path);
+}
+
+/**
+ * @brief 读取root下pid的log目录中的nodes.log，返回其中的根目录个数
+ * 没有该文件时返回0，说明进程在写入任何log之前就崩溃了
+ */
+static int load_log_nodes(const char *root, unsigned long pid,
+                          char (*paths)[LOG_ROOT_SIZE]) {
+  char filename[LOG_PATH_SIZE];
+  size_t len;
+  FILE *fp;
+  int nr = 0;
+
+  sprintf(filename, NODES_PATH, root, pid);
+  fp = fopen(filename, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+
+  while (nr < MAX_NR_LOG_NODES && fgets(paths[nr], LOG_ROOT_SIZE, fp) != NULL) {
+    len = strlen(paths[nr]);
+    if (__glibc_unlikely(len == 0 || paths[nr][len - 1] != '\n')) {
+      handle_error_en(ENAMETOOLONG, filename);
+    }
+    paths[nr][len - 1] = '\0';
+    nr++;
+  }
+  fclose(fp);
+  return nr;
+}
+
+/**
+ * @brief 恢复pid遗留的全部log目录，root是发现其中一个目录的根目录
+ *
+ * 元数据目录总是最先被删除：它不存在而所在的根目录存在时，root下的目录是
+ * 清理到一半时崩溃留下的，直接删除。元数据所在的根目录不可访问，或者
+ * 元数据目录存在而其它log node的目录缺失时，log无法完整恢复，报错退出
+ */
+static void recover_process_logs(const char *root, unsigned long pid) {
+  char paths[MAX_NR_LOG_NODES][LOG_ROOT_SIZE];
+  char path[LOG_PATH_SIZE];
+  int fds[MAX_NR_LOG_NODES];
+  int node, nr_nodes;
+
+  nr_nodes = load_log_nodes(root, pid, paths);
+  if (nr_nodes == 0) {
+    sprintf(path, DIR_PATH, root, pid);
+    remove_log_dir(path);
+    return;
+  }
+
+  if (__glibc_unlikely(access(paths[0], F_OK) != 0)) {
+    LIBNVMMIO_DEBUG("logs of pid %lu need %s", pid, paths[0]);
+    handle_error(paths[0]);
+  }
+
+  sprintf(path, NODE_DIR_PATH, LOG_ROOT_SIZE, paths[0], pid);
+  if (access(path, F_OK) != 0) {
+    sprintf(path, DIR_PATH, root, pid);
+    remove_log_dir(path);
+    return;
+  }
+
+  /* 所属进程仍在运行，或正在被其他进程恢复 */
+  fds[0] = lock_log_dir(path);
+  if (fds[0] == -1) {
+    return;
+  }
+
+  for (node = 1; node < nr_nodes; node++) {
+    sprintf(path, NODE_DIR_PATH, LOG_ROOT_SIZE, paths[node], pid);
+    fds[node] = lock_log_dir(path);
+    if (__glibc_unlikely(fds[node] == -1)) {
+      LIBNVMMIO_DEBUG("logs of pid %lu need %s", pid, path);
+      handle_error(path);
+    }
+  }
+
+  recover_log_dir(paths, nr_nodes, pid);
+
+  for (node = 0; node < nr_nodes; node++) {
+    sprintf(path, NODE_DIR_PATH, LOG_ROOT_SIZE, paths[node], pid);
+    rmlogs(path);
+    close(fds[node]);
+    LIBNVMMIO_DEBUG("recovered %s", path);
+  }
+}
+
+/**
+ * @brief 恢复一个PMEM根目录下发现的崩溃进程遗留的log目录
+ */
+static void recover_root_logs(const char *root) {
+  struct dirent *file;
+  unsigned long pid;
+  DIR *dir;
+
+  dir = opendir(root);
+  if (__glibc_unlikely(dir == NULL)) {
+    handle_error("opendir");
+  }
+
+  while ((file = readdir(dir)) != NULL) {
+    pid = get_log_dir_pid(file->d_name);
+    if (pid != 0) {
+      recover_process_logs(root, pid);
+    }
+  }
+
+  closedir(dir);
+}
+
+/**
+ * @brief 在PMEM_PATH下查找崩溃进程遗留的log目录，恢复后删除
+ * 每个根目录都要查找，PMEM_PATH改变顺序后元数据目录可能不在第0个路径下
+ */
+void recover_logs(void) {
+  int node;
+
+  for (node = 0; node < get_nr_log_nodes(); node++) {
+    recover_root_logs(get_pmem_path(node));
+  }
+}
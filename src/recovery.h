@@ -0,0 +1,9 @@
+#ifndef _LIBNVMMIO_RECOVERY_H
+#define _LIBNVMMIO_RECOVERY_H
+
+#define MAX_NR_RECOVERY_THREADS (16)
+#define RECOVERY_THREADS_ENV "NVMMIO_RECOVERY_THREADS"
+
+void recover_logs(void);
+
+#endif /* _LIBNVMMIO_RECOVERY_H */
@@ -0,0 +1,606 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "internal.h"
+#include "list.h"
+#include "nvmmio.h"
+#include "sync.h"
+#include "debug.h"
+
+/**
+ * @brief 所有映射文件共享的后台同步线程池
+ *
+ * nvmsync_uma()增加epoch之后将uma放入队列，同步线程被唤醒后
+ * 将已提交的log entry写回映射文件。队列为空时同步线程在条件变量上睡眠。
+ *
+ * 同步的节奏由log空间的压力决定：空间充足时放慢重试，低于LOG_LOW_WATERMARK
+ * 时唤醒所有同步线程，低于LOG_MIN_WATERMARK时写线程被限流并协助同步。
+ *
+ * 同步线程优先执行tasks中的任务，用于把大的fsync拆分给多个线程并行写回。
+ *
+ * nvfsync_async()在uma->waiters中登记等待者，sync_uma()写回全部已提交的
+ * entry后推进uma->synced_epoch，同步线程在释放pool的锁之后通知已达到的等待者。
+ *
+ * 有多个log node时每个node一个队列，uma排在提交它的线程的log node上；
+ * 同步线程绑定到各个node的CPU上，优先处理本node的队列，空闲时再处理其它node的。
+ */
+typedef struct sync_pool_struct {
+  struct list_head queues[MAX_NR_LOG_NODES];
+  int nr_nodes;
+  struct list_head tasks;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; /* 唤醒同步线程 */
+  pthread_cond_t idle; /* uma处理完成，唤醒cancel_sync_uma() */
+  pthread_cond_t done; /* 一批任务完成，唤醒run_sync_tasks() */
+  bool stop;
+  int nr_threads;
+  int nr_cpus;
+  int cpus[MAX_NR_SYNC_THREADS];
+  pthread_t tid[MAX_NR_SYNC_THREADS];
+} sync_pool_t;
+
+static sync_pool_t sync_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void pool_lock(void) {
+  int s;
+
+  s = pthread_mutex_lock(&sync_pool.mutex);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error_en(s, "pthread_mutex_lock");
+  }
+}
+
+static void pool_unlock(void) {
+  int s;
+
+  s = pthread_mutex_unlock(&sync_pool.mutex);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error_en(s, "pthread_mutex_unlock");
+  }
+}
+
+/**
+ * @brief 解析"0-3,8,10"格式的CPU列表
+ */
+static int parse_cpu_list(const char *str, int *cpus, int max) {
+  char *buf, *token, *saveptr;
+  int first, last, cpu, nr = 0;
+
+  buf = strdup(str);
+  if (__glibc_unlikely(buf == NULL)) {
+    handle_error("strdup");
+  }
+
+  for (token = strtok_r(buf, ",", &saveptr); token != NULL && nr < max;
+       token = strtok_r(NULL, ",", &saveptr)) {
+    if (sscanf(token, "%d-%d", &first, &last) != 2) {
+      if (sscanf(token, "%d", &first) != 1) {
+        continue;
+      }
+      last = first;
+    }
+
+    for (cpu = first; cpu <= last && nr < max; cpu++) {
+      cpus[nr++] = cpu;
+    }
+  }
+
+  free(buf);
+  return nr;
+}
+
+/**
+ * @brief 读取NUMA node的CPU列表，没有该node时返回0
+ */
+static int get_node_cpus(int node, int *cpus, int max) {
+  char path[64], buf[1024];
+  FILE *fp;
+  int nr = 0;
+
+  sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  if (fgets(buf, sizeof(buf), fp) != NULL) {
+    nr = parse_cpu_list(buf, cpus, max);
+  }
+  fclose(fp);
+  return nr;
+}
+
+/**
+ * @brief 没有指定SYNC_CPUS_ENV时，有多个log node的同步线程绑定到所属node的CPU上
+ */
+static void set_sync_thread_affinity(int id) {
+  int cpus[CPU_SETSIZE];
+  cpu_set_t cpuset;
+  int i, nr, s;
+
+  CPU_ZERO(&cpuset);
+
+  if (sync_pool.nr_cpus > 0) {
+    CPU_SET(sync_pool.cpus[id % sync_pool.nr_cpus], &cpuset);
+  } else if (sync_pool.nr_nodes > 1) {
+    nr = get_node_cpus(id % sync_pool.nr_nodes, cpus, CPU_SETSIZE);
+    if (nr == 0) {
+      return;
+    }
+    for (i = 0; i < nr; i++) {
+      CPU_SET(cpus[i], &cpuset);
+    }
+  } else {
+    return;
+  }
+
+  s = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+  if (__glibc_unlikely(s != 0)) {
+    handle_error_en(s, "pthread_setaffinity_np");
+  }
+}
+
+/**
+ * @brief 根据log空间压力决定entry被占用时的重试间隔
+ */
+static unsigned long sync_retry_period(void) {
+  switch (get_log_space(NR_LOG_SIZES)) {
+    case LOG_SPACE_OK:
+      return SYNC_MAX_PERIOD;
+    case LOG_SPACE_LOW:
+      return SYNC_PERIOD;
+    default:
+      return 0;
+  }
+}
+
+static inline void wait_retry_period(void) {
+  unsigned long period = sync_retry_period();
+
+  if (period > 0) {
+    usleep(period);
+  } else {
+    sched_yield();
+  }
+}
+
+/**
+ * @brief 写回完成后的通知，早于epoch的entry全部写回后调用func并写eventfd
+ */
+typedef struct sync_waiter_struct {
+  struct list_head list;
+  unsigned long epoch;
+  void (*func)(int fd, void *cookie);
+  void *cookie;
+  int fd;
+  int efd; /* 小于0时不使用eventfd */
+} sync_waiter_t;
+
+/**
+ * @brief 取出已经达到的等待者，调用时需持有pool的锁
+ * @param all 为true时不检查epoch，用于取消映射之前
+ */
+static void collect_sync_waiters(uma_t *uma, struct list_head *done, bool all) {
+  sync_waiter_t *waiter, *next;
+
+  list_for_each_entry_safe(waiter, next, &uma->waiters, list) {
+    if (all || waiter->epoch <= uma->synced_epoch) {
+      list_move_tail(&waiter->list, done);
+    }
+  }
+}
+
+/**
+ * @brief 通知done中的等待者，不能持有pool的锁，回调中可能再次调用nvfsync_async()
+ */
+static void complete_sync_waiters(struct list_head *done) {
+  sync_waiter_t *waiter, *next;
+  uint64_t one = 1;
+
+  list_for_each_entry_safe(waiter, next, done, list) {
+    list_del(&waiter->list);
+
+    if (waiter->func != NULL) {
+      waiter->func(waiter->fd, waiter->cookie);
+    }
+    if (waiter->efd >= 0 &&
+        write(waiter->efd, &one, sizeof(one)) != sizeof(one)) {
+      LIBNVMMIO_DEBUG("cannot signal eventfd %d", waiter->efd);
+    }
+    free(waiter);
+  }
+}
+
+static bool sync_queue_empty(void) {
+  int node;
+
+  for (node = 0; node < sync_pool.nr_nodes; node++) {
+    if (!list_empty(&sync_pool.queues[node])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief 优先取node队列中的uma，调用时需持有pool的锁且队列不为空
+ */
+static inline struct mmap_area_struct *dequeue_sync_uma(int node) {
+  uma_t *uma;
+  int i;
+
+  for (i = 0; i < sync_pool.nr_nodes; i++) {
+    if (!list_empty(&sync_pool.queues[(node + i) % sync_pool.nr_nodes])) {
+      break;
+    }
+  }
+
+  uma = list_first_entry(&sync_pool.queues[(node + i) % sync_pool.nr_nodes],
+                         uma_t, list);
+  list_del(&uma->list);
+  uma->sync_state = SYNC_RUNNING;
+
+  return uma;
+}
+
+/**
+ * @brief 一次同步结束后更新uma的状态，调用时需持有pool的锁
+ */
+static void finish_sync_uma(uma_t *uma, unsigned long left,
+                            struct list_head *done) {
+  collect_sync_waiters(uma, done, false);
+
+  if (uma->sync_state == SYNC_RERUN || left > 0) {
+    uma->sync_state = SYNC_QUEUED;
+    list_add_tail(&uma->list, &sync_pool.queues[uma->sync_node]);
+  } else {
+    uma->sync_state = SYNC_IDLE;
+  }
+  pthread_cond_broadcast(&sync_pool.idle);
+}
+
+/**
+ * @brief 执行一个任务，调用时需持有pool的锁
+ */
+static void run_sync_task(void) {
+  sync_task_t *task;
+
+  task = list_first_entry(&sync_pool.tasks, sync_task_t, list);
+  list_del(&task->list);
+
+  pool_unlock();
+  task->func(task->arg);
+  pool_lock();
+
+  *task->pending -= 1;
+  if (*task->pending == 0) {
+    pthread_cond_broadcast(&sync_pool.done);
+  }
+}
+
+/**
+ * @brief 同步线程执行函数
+ */
+static void *sync_thread_func(void *parm) {
+  LIST_HEAD(done);
+  uma_t *uma;
+  unsigned long left;
+  int id = (int)(long)parm;
+  int node = id % sync_pool.nr_nodes;
+
+  set_sync_thread_affinity(id);
+
+  LIBNVMMIO_DEBUG("sync thread %d start on %d", id, sched_getcpu());
+
+  pool_lock();
+
+  while (true) {
+    while (sync_queue_empty() && list_empty(&sync_pool.tasks) &&
+           !sync_pool.stop) {
+      pthread_cond_wait(&sync_pool.cond, &sync_pool.mutex);
+    }
+
+    if (!list_empty(&sync_pool.tasks)) {
+      run_sync_task();
+      continue;
+    }
+
+    if (sync_queue_empty()) {
+      break;
+    }
+
+    uma = dequeue_sync_uma(node);
+
+    pool_unlock();
+
+    left = sync_uma(uma);
+
+    /* 已提交的entry正被写线程占用，稍后重试 */
+    if (left > 0) {
+      wait_retry_period();
+    }
+
+    pool_lock();
+    finish_sync_uma(uma, left, &done);
+
+    if (!list_empty(&done)) {
+      pool_unlock();
+      complete_sync_waiters(&done);
+      pool_lock();
+    }
+  }
+
+  pool_unlock();
+  return NULL;
+}
+
+/**
+ * @brief 将uma放入同步队列，调用时需持有pool的锁
+ */
+static void __enqueue_sync_uma(uma_t *uma) {
+  switch (uma->sync_state) {
+    case SYNC_IDLE:
+      uma->sync_state = SYNC_QUEUED;
+      uma->sync_node = get_local_log_node();
+      list_add_tail(&uma->list, &sync_pool.queues[uma->sync_node]);
+
+      if (get_log_space(NR_LOG_SIZES) == LOG_SPACE_OK) {
+        pthread_cond_signal(&sync_pool.cond);
+      } else {
+        pthread_cond_broadcast(&sync_pool.cond);
+      }
+      break;
+    case SYNC_RUNNING:
+      uma->sync_state = SYNC_RERUN;
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * @brief 将含有已提交log entry的uma放入同步队列
+ */
+void enqueue_sync_uma(uma_t *uma) {
+  pool_lock();
+  __enqueue_sync_uma(uma);
+  pool_unlock();
+}
+
+/**
+ * @brief 登记一个等待者，早于epoch的entry全部写回后由同步线程通知
+ * 已经全部写回时直接在当前线程通知
+ */
+void notify_sync_uma(uma_t *uma, unsigned long epoch,
+                     void (*func)(int fd, void *cookie), void *cookie, int fd,
+                     int efd) {
+  LIST_HEAD(done);
+  sync_waiter_t *waiter;
+
+  waiter = (sync_waiter_t *)malloc(sizeof(sync_waiter_t));
+  if (__glibc_unlikely(waiter == NULL)) {
+    handle_error("malloc");
+  }
+  waiter->epoch = epoch;
+  waiter->func = func;
+  waiter->cookie = cookie;
+  waiter->fd = fd;
+  waiter->efd = efd;
+
+  pool_lock();
+  list_add_tail(&waiter->list, &uma->waiters);
+  collect_sync_waiters(uma, &done, false);
+
+  /* 即使没有dirty table，也要由同步线程确认并推进synced_epoch */
+  if (list_empty(&done)) {
+    __enqueue_sync_uma(uma);
+  }
+  pool_unlock();
+
+  complete_sync_waiters(&done);
+}
+
+bool has_sync_waiters(uma_t *uma) {
+  return !list_empty(&uma->waiters);
+}
+
+/**
+ * @brief 将uma移出同步队列，并等待正在进行的同步结束
+ * 调用者已经用MS_SYNC写回了整个文件，剩下的等待者直接通知
+ */
+void cancel_sync_uma(uma_t *uma) {
+  LIST_HEAD(done);
+
+  pool_lock();
+
+  if (uma->sync_state == SYNC_QUEUED) {
+    list_del(&uma->list);
+    uma->sync_state = SYNC_IDLE;
+  }
+
+  while (uma->sync_state != SYNC_IDLE) {
+    pthread_cond_wait(&sync_pool.idle, &sync_pool.mutex);
+
+    if (uma->sync_state == SYNC_QUEUED) {
+      list_del(&uma->list);
+      uma->sync_state = SYNC_IDLE;
+    }
+  }
+  collect_sync_waiters(uma, &done, true);
+
+  pool_unlock();
+
+  complete_sync_waiters(&done);
+}
+
+/**
+ * @brief 在调用线程中处理一个排队的uma
+ * @return 队列为空时返回false
+ */
+static bool help_sync(void) {
+  LIST_HEAD(done);
+  uma_t *uma;
+  unsigned long left;
+
+  pool_lock();
+
+  if (sync_queue_empty()) {
+    pool_unlock();
+    return false;
+  }
+  uma = dequeue_sync_uma(get_local_log_node());
+
+  pool_unlock();
+
+  left = sync_uma(uma);
+
+  pool_lock();
+  finish_sync_uma(uma, left, &done);
+  pool_unlock();
+
+  complete_sync_waiters(&done);
+  return true;
+}
+
+/**
+ * @brief 等待log空间被回收的一次退避
+ * 唤醒全部同步线程，并在调用线程中协助同步；没有可同步的uma时睡眠，
+ * 睡眠时间随已等待的时间指数增长
+ *
+ * @param waited 累计等待的时间(us)
+ * @return 累计等待超过LOG_SPACE_TIMEOUT时返回false
+ */
+bool wait_for_log_space(unsigned long *waited) {
+  unsigned long delay;
+
+  pool_lock();
+  pthread_cond_broadcast(&sync_pool.cond);
+  pool_unlock();
+
+  delay = *waited < THROTTLE_MIN_DELAY ? THROTTLE_MIN_DELAY : *waited;
+  if (delay > THROTTLE_MAX_DELAY) {
+    delay = THROTTLE_MAX_DELAY;
+  }
+
+  if (!help_sync()) {
+    usleep(delay);
+  }
+  *waited += delay;
+
+  return *waited < LOG_SPACE_TIMEOUT;
+}
+
+/**
+ * @brief 空闲log空间低于LOG_MIN_WATERMARK时限制写线程
+ * 必须在获取uma的锁之前调用，最多等待THROTTLE_MAX_WAIT
+ */
+void throttle_log_writer(log_size_t log_size) {
+  unsigned long waited = 0;
+
+  if (__glibc_likely(get_log_space(log_size) != LOG_SPACE_MIN)) {
+    return;
+  }
+
+  while (get_log_space(log_size) == LOG_SPACE_MIN && waited < THROTTLE_MAX_WAIT) {
+    wait_for_log_space(&waited);
+  }
+}
+
+/**
+ * @brief 把一批任务交给同步线程并行执行，调用线程也参与执行，全部完成后返回
+ */
+void run_sync_tasks(sync_task_t *tasks, int nr) {
+  int i, pending = nr;
+
+  pool_lock();
+
+  for (i = 0; i < nr; i++) {
+    tasks[i].pending = &pending;
+    list_add_tail(&tasks[i].list, &sync_pool.tasks);
+  }
+  pthread_cond_broadcast(&sync_pool.cond);
+
+  while (!list_empty(&sync_pool.tasks)) {
+    run_sync_task();
+  }
+
+  /* 剩下的任务正在同步线程中执行 */
+  while (pending > 0) {
+    pthread_cond_wait(&sync_pool.done, &sync_pool.mutex);
+  }
+
+  pool_unlock();
+}
+
+int get_nr_sync_threads(void) {
+  return sync_pool.nr_threads;
+}
+
+void init_sync_threads(void) {
+  char *env;
+  long i;
+  int s;
+
+  sync_pool.nr_nodes = get_nr_log_nodes();
+  for (i = 0; i < sync_pool.nr_nodes; i++) {
+    INIT_LIST_HEAD(&sync_pool.queues[i]);
+  }
+  INIT_LIST_HEAD(&sync_pool.tasks);
+  sync_pool.stop = false;
+  sync_pool.nr_threads = DEFAULT_NR_SYNC_THREADS;
+
+  env = getenv(SYNC_THREADS_ENV);
+  if (env != NULL) {
+    sync_pool.nr_threads = atoi(env);
+  }
+
+  if (sync_pool.nr_threads < 1) {
+    sync_pool.nr_threads = 1;
+  } else if (sync_pool.nr_threads > MAX_NR_SYNC_THREADS) {
+    sync_pool.nr_threads = MAX_NR_SYNC_THREADS;
+  }
+
+  env = getenv(SYNC_CPUS_ENV);
+  if (env != NULL) {
+    sync_pool.nr_cpus = parse_cpu_list(env, sync_pool.cpus, MAX_NR_SYNC_THREADS);
+  }
+
+  for (i = 0; i < sync_pool.nr_threads; i++) {
+    s = pthread_create(&sync_pool.tid[i], NULL, sync_thread_func, (void *)i);
+    if (__glibc_unlikely(s != 0)) {
+      handle_error_en(s, "pthread_create");
+    }
+  }
+}
+
+/**
+ * @brief 处理完队列中剩余的uma后结束所有同步线程
+ */
+void exit_sync_threads(void) {
+  int i, s;
+
+  pool_lock();
+  sync_pool.stop = true;
+  pthread_cond_broadcast(&sync_pool.cond);
+  pool_unlock();
+
+  for (i = 0; i < sync_pool.nr_threads; i++) {
+    s = pthread_join(sync_pool.tid[i], NULL);
+    if (__glibc_unlikely(s != 0)) {
+      handle_error_en(s, "pthread_join");
+    }
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef _LIBNVMMIO_SYNC_H
+#define _LIBNVMMIO_SYNC_H
+
+#include <stdbool.h>
+
+#include "internal.h"
+#include "list.h"
+#include "uma.h"
+
+#define DEFAULT_NR_SYNC_THREADS (2)
+#define MAX_NR_SYNC_THREADS (64)
+
+#define SYNC_MAX_PERIOD (SYNC_PERIOD << 6) /* log空间充足时的重试间隔 */
+#define THROTTLE_MIN_DELAY (1)               /* 限流的初始退避时间(us) */
+#define THROTTLE_MAX_DELAY (1000)            /* 限流的最大退避时间(us) */
+#define THROTTLE_MAX_WAIT (10000)            /* 每次写入最多被限流10ms */
+#define LOG_SPACE_TIMEOUT (1000000)          /* log耗尽时最多等待1s */
+
+#define SYNC_THREADS_ENV "NVMMIO_SYNC_THREADS"
+#define SYNC_CPUS_ENV "NVMMIO_SYNC_CPUS"
+
+typedef enum {
+  SYNC_IDLE,    /* 不在队列中 */
+  SYNC_QUEUED,  /* 等待同步线程处理 */
+  SYNC_RUNNING, /* 正在被同步线程处理 */
+  SYNC_RERUN    /* 处理期间epoch再次增加，处理完后重新入队 */
+} sync_state_t;
+
+/**
+ * @brief 交给同步线程池执行的任务，run_sync_tasks()返回前全部完成
+ */
+typedef struct sync_task_struct {
+  struct list_head list;
+  void (*func)(void *arg);
+  void *arg;
+  int *pending; /* 同一批中尚未完成的任务个数 */
+} sync_task_t;
+
+void init_sync_threads(void);
+int get_nr_sync_threads(void);
+void run_sync_tasks(sync_task_t *tasks, int nr);
+void exit_sync_threads(void);
+void enqueue_sync_uma(struct mmap_area_struct *uma);
+void cancel_sync_uma(struct mmap_area_struct *uma);
+void notify_sync_uma(struct mmap_area_struct *uma, unsigned long epoch,
+                     void (*func)(int fd, void *cookie), void *cookie, int fd,
+                     int efd);
+bool has_sync_waiters(struct mmap_area_struct *uma);
+void throttle_log_writer(log_size_t log_size);
+bool wait_for_log_space(unsigned long *waited);
+
+#endif /* _LIBNVMMIO_SYNC_H */
@@ -2,7 +2,10 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "allocator.h"
 #include "internal.h"
@@ -25,6 +28,14 @@ static list_t uma_list;
 static uma_t *uma_fdarray[MAX_NR_UMAS];
 
 static rbtree_t *uma_rbtree = NULL;
+
+/**
+ * @brief nvmmap分配的映射都按table对齐且互不共享table，
+ * 窗口内的地址直接用(addr - uma_window_start) >> TABLE_SHIFT找到uma
+ */
+static uma_t **uma_directory = NULL;
+static unsigned long uma_window_start;
+static unsigned long nr_outside_umas = 0; /* 不在窗口内的uma个数 */
 /**
  * @brief 缓存部分PerFile-Metadata。用于加速寻找
  * 
@@ -98,9 +109,32 @@ find_uma_rbtree_success:
   return uma;
 }
 
+static inline bool in_uma_window(uma_t *uma) {
+  return uma_directory != NULL &&
+         (unsigned long)uma->start >= uma_window_start &&
+         (unsigned long)uma->end <= uma_window_start + UMA_WINDOW_SIZE;
+}
+
+static inline unsigned long uma_directory_index(const void *addr) {
+  return ((unsigned long)addr - uma_window_start) >> TABLE_SHIFT;
+}
+
 uma_t *find_uma(const void *addr) {
+  unsigned long index;
   uma_t *uma;
 
+  index = uma_directory_index(addr);
+  if (uma_directory != NULL && index < UMA_DIR_ENTRIES) {
+    uma = __atomic_load_n(&uma_directory[index], __ATOMIC_ACQUIRE);
+    if (uma != NULL && uma->start <= addr && addr < uma->end) {
+      return uma;
+    }
+    /* 所有uma都在directory中，不必再查rbtree */
+    if (nr_outside_umas == 0) {
+      return NULL;
+    }
+  }
+
   uma = find_uma_cache(addr);
   if (uma != NULL && uma->epoch > 0) {
     goto find_uma_out;
@@ -165,6 +199,70 @@ void insert_uma_syncthreads(uma_t *new_uma) {
 }
 */
 
+void init_uma_directory(void *window_start) {
+  void *addr;
+
+  if (uma_directory == NULL) {
+    /* 只有被使用的部分才会分配物理内存 */
+    addr = mmap(NULL, UMA_DIR_ENTRIES * sizeof(uma_t *), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (__glibc_unlikely(addr == MAP_FAILED)) {
+      handle_error("mmap for uma_directory");
+    }
+    uma_window_start = (unsigned long)window_start;
+    uma_directory = (uma_t **)addr;
+  }
+}
+
+static void clear_uma_directory(uma_t *uma, unsigned long first,
+                                unsigned long last) {
+  unsigned long index;
+
+  for (index = first; index <= last; index++) {
+    __sync_bool_compare_and_swap(&uma_directory[index], uma, NULL);
+  }
+}
+
+/**
+ * @brief uma初始化完成后发布到directory
+ *
+ * 调用者指定地址的映射可能与其他uma共享table，这类uma和窗口外的uma一样
+ * 只能通过rbtree查找
+ */
+void insert_uma_directory(uma_t *uma) {
+  unsigned long index, first, last;
+
+  if (in_uma_window(uma)) {
+    first = uma_directory_index(uma->start);
+    last = uma_directory_index(uma->end - 1);
+    for (index = first; index <= last; index++) {
+      if (!__sync_bool_compare_and_swap(&uma_directory[index], NULL, uma)) {
+        break;
+      }
+    }
+    if (index > last) {
+      return;
+    }
+    if (index > first) {
+      clear_uma_directory(uma, first, index - 1);
+    }
+  }
+  __sync_fetch_and_add(&nr_outside_umas, 1);
+}
+
+void delete_uma_directory(uma_t *uma) {
+  unsigned long first;
+
+  if (in_uma_window(uma)) {
+    first = uma_directory_index(uma->start);
+    if (uma_directory[first] == uma) {
+      clear_uma_directory(uma, first, uma_directory_index(uma->end - 1));
+      return;
+    }
+  }
+  __sync_fetch_and_sub(&nr_outside_umas, 1);
+}
+
 void insert_uma_fdarray(int fd, uma_t *new_uma) { uma_fdarray[fd] = new_uma; }
 
 uma_t *get_uma_fdarray(int fd) { return uma_fdarray[fd]; }
@@ -250,22 +348,6 @@ void init_uma(void) {
   }
 }
 
-inline void increase_uma_read_cnt(uma_t *uma) {
-  int old, new;
-
-  LIBNVMMIO_INIT_TIME(increase_uma_read_cnt_time);
-  LIBNVMMIO_START_TIME(increase_uma_read_cnt_t, increase_uma_read_cnt_time);
-
-  /* TODO: It is necessary to check whether the counter does not exceed the
-   * ULONG_MAX */
-  do {
-    old = uma->read;
-    new = old + 1;
-  } while (!__sync_bool_compare_and_swap(&uma->read, old, new));
-
-  LIBNVMMIO_END_TIME(increase_uma_read_cnt_t, increase_uma_read_cnt_time);
-}
-
 /**
  * @brief 当前epoch下该文件写请求次数加1
  */
@@ -284,3 +366,79 @@ inline void increase_uma_write_cnt(uma_t *uma) {
 
   LIBNVMMIO_END_TIME(increase_uma_write_cnt_t, increase_uma_write_cnt_time);
 }
+
+/**
+ * @brief 通过/proc/self/fd记录映射文件的路径
+ * 获取失败时path为空，该uma的log在崩溃后无法恢复
+ */
+void set_uma_path(uma_t *uma, int fd) {
+  char link[32];
+  ssize_t len;
+
+  sprintf(link, "/proc/self/fd/%d", fd);
+  len = readlink(link, uma->path, sizeof(uma->path) - 1);
+  if (__glibc_unlikely(len < 0)) {
+    LIBNVMMIO_DEBUG("readlink failed, fd=%d", fd);
+    len = 0;
+  }
+  uma->path[len] = '\0';
+}
+
+/**
+ * @brief 为uma分配dirty table位图
+ * 每个bit对应映射区域中的一个2MB table，写入新的log entry时置位，
+ * 后台同步线程只需要遍历被置位的table，而不是整个映射区域
+ */
+void init_uma_dirty_tables(uma_t *uma) {
+  unsigned long base;
+
+  base = (unsigned long)ALIGN_TABLE(uma->start);
+  uma->nr_tables = (((unsigned long)uma->end - 1 - base) >> TABLE_SHIFT) + 1;
+  uma->dirty_tables = (unsigned long *)calloc(DIRTY_WORDS(uma->nr_tables),
+                                              sizeof(unsigned long));
+  if (__glibc_unlikely(uma->dirty_tables == NULL)) {
+    handle_error("calloc for dirty_tables");
+  }
+}
+
+void free_uma_dirty_tables(uma_t *uma) {
+  free(uma->dirty_tables);
+  uma->dirty_tables = NULL;
+  uma->nr_tables = 0;
+}
+
+/**
+ * @brief 将address所在的table标记为dirty
+ * 必须在log entry插入table之后调用，保证同步线程清除bit之后一定能看到该entry
+ */
+inline void mark_uma_table_dirty(uma_t *uma, unsigned long address) {
+  unsigned long index, mask;
+
+  index = (address - (unsigned long)ALIGN_TABLE(uma->start)) >> TABLE_SHIFT;
+  mask = 1UL << (index % BITS_PER_LONG);
+
+  if (!(uma->dirty_tables[index / BITS_PER_LONG] & mask)) {
+    __sync_fetch_and_or(&uma->dirty_tables[index / BITS_PER_LONG], mask);
+  }
+}
+
+bool is_uma_dirty(uma_t *uma) {
+  unsigned long word;
+
+  for (word = 0; word < DIRTY_WORDS(uma->nr_tables); word++) {
+    if (uma->dirty_tables[word]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief 原子地取出并清空一个位图字
+ */
+inline unsigned long fetch_uma_dirty_tables(uma_t *uma, unsigned long word) {
+  if (uma->dirty_tables[word] == 0) {
+    return 0;
+  }
+  return __sync_fetch_and_and(&uma->dirty_tables[word], 0UL);
+}
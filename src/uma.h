@@ -2,14 +2,24 @@
 #define _LIBNVMMIO_UMA_H
 #define _GNU_SOURCE
 
+#include <limits.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 #include "list.h"
 #include "rbtree.h"
 
 #define MAX_NR_UMAS (1UL << 10)
-#define SYNC_PERIOD (10)
+#define SYNC_PERIOD (10) /* 已提交entry被占用时，同步线程重试前等待的微秒数 */
+
+#define UMA_FILE_SIZE_UNKNOWN (~0UL) /* 不是通过nvopen映射的文件，不记录长度 */
+
+#define UMA_WINDOW_SIZE (1UL << 38) /* nvmmap分配映射地址的窗口，256GB */
+#define UMA_DIR_ENTRIES (UMA_WINDOW_SIZE >> 21) /* 窗口中每个table一项 */
+
+#define BITS_PER_LONG (64)
+#define DIRTY_WORDS(nr_tables) (((nr_tables) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
 typedef enum { UNDO, REDO } log_policy_t;
 
@@ -19,29 +29,30 @@ typedef enum { UNDO, REDO } log_policy_t;
 #define DEFAULT_POLICY (REDO)
 #endif
 
-typedef struct sync_thread_struct {
-  int id;
-  pthread_t tid[2];
-  // pthread_cond_t cond;
-  // pthread_mutex_t mutex;
-  void *uma;
-} sync_thread_t;
-
 typedef struct mmap_area_struct {
   unsigned long epoch;  // 全局版本号
-  unsigned long policy; // 日志策略
   void *start;  // mmap file起始地址
   void *end;  // mmap file终止地址
   unsigned long ino; // inode
   off_t offset; // 一般为0，代表为文件起始处开始映射
-  unsigned long read; // 处理读请求的数据
-  unsigned long write;
+  unsigned long write; // 上次提交之后的写请求次数
   struct thread_info_struct *tinfo; // 未使用
   pthread_rwlock_t *rwlockp;
   struct rb_node rb;  // 在rbtree中的节点
-  struct list_head list;// 同步线程链表中的元素(未使用)
+  struct list_head list;// 同步线程池队列中的元素
   int id;
-  pthread_t sync_thread; // 用于同步的后台线程
+  int sync_state; // 在同步线程池中的状态，见sync_state_t
+  int sync_node; // 排队所在的log node，即提交它的线程的log node
+  unsigned long *dirty_tables; // 含有log entry的table位图，每个bit对应2MB
+  unsigned long nr_tables; // 映射区域覆盖的table个数
+  char path[PATH_MAX]; // 映射文件的路径，崩溃恢复时用于重新打开文件
+  unsigned long file_size[2]; // 已提交的文件长度，按epoch的奇偶交替写入，崩溃恢复时截断到file_size[epoch & 1]
+  unsigned long pending_file_size; // 未提交的文件长度，提交时随epoch一起持久化
+  int nr_leases; // nvpread_zc()持有的lease个数，非0时log数据不会被回收
+  struct retired_data_struct *retired; // lease期间被替换下来的data块
+  unsigned long *applied; // 每个table已写回到的epoch，映射在applied.log中
+  unsigned long synced_epoch; // 早于该epoch的entry已全部写回
+  struct list_head waiters; // 等待写回完成的nvfsync_async()，由同步线程池的锁保护
 } uma_t;
 
 typedef struct list_struct {
@@ -50,6 +61,9 @@ typedef struct list_struct {
 } list_t;
 
 void init_uma(void);
+void init_uma_directory(void *window_start);
+void insert_uma_directory(struct mmap_area_struct *uma);
+void delete_uma_directory(struct mmap_area_struct *uma);
 void insert_uma_rbtree(struct mmap_area_struct *new_uma);
 void insert_uma_syncthreads(uma_t *new_uma);
 void insert_uma_fdarray(int fd, uma_t *new_uma);
@@ -59,7 +73,13 @@ void delete_uma_rbtree(struct mmap_area_struct *uma);
 void delete_uma_syncthreads(struct mmap_area_struct *uma);
 void delete_uma_fdarray(int fd);
 struct list_struct *get_uma_list(void);
-void increase_uma_read_cnt(struct mmap_area_struct *uma);
 void increase_uma_write_cnt(struct mmap_area_struct *uma);
+void set_uma_path(struct mmap_area_struct *uma, int fd);
+void init_uma_dirty_tables(struct mmap_area_struct *uma);
+void free_uma_dirty_tables(struct mmap_area_struct *uma);
+void mark_uma_table_dirty(struct mmap_area_struct *uma, unsigned long address);
+bool is_uma_dirty(struct mmap_area_struct *uma);
+unsigned long fetch_uma_dirty_tables(struct mmap_area_struct *uma,
+                                     unsigned long word);
 
 #endif /* _LIBNVMMIO_UMA_H */